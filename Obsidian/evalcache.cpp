@@ -0,0 +1,34 @@
+#include "evalcache.h"
+
+#include <cstring>
+
+namespace Eval {
+
+  constexpr size_t MEGA = 1024 * 1024;
+
+  EvalCache::~EvalCache() {
+    delete[] buckets;
+  }
+
+  void EvalCache::resize(size_t megaBytes) {
+    delete[] buckets;
+    buckets = nullptr;
+    bucketCount = 0;
+
+    if (!megaBytes)
+      return;
+
+    // Round down to a power of two, so that indexing is just a mask
+    bucketCount = 1;
+    while (bucketCount * 2 * sizeof(Bucket) <= megaBytes * MEGA)
+      bucketCount *= 2;
+
+    buckets = new Bucket[bucketCount];
+    clear();
+  }
+
+  void EvalCache::clear() {
+    if (buckets)
+      memset(buckets, 0, bucketCount * sizeof(Bucket));
+  }
+}
@@ -0,0 +1,72 @@
+#pragma once
+
+#include "types.h"
+
+namespace Eval {
+
+  /// A small per-thread cache of raw network outputs, so that transpositions which
+  /// missed the TT static eval don't go through the accumulators and the output layer again
+  struct EvalCache {
+
+    // The low 16 bits of an entry hold the score, the rest is the upper part of the key.
+    // Buckets are indexed by the low bits of the key: below 65536 buckets, the key bits
+    // between the index and bit 16 are not verified; above it, the index repeats some of
+    // the stored bits
+    static constexpr int EntriesPerBucket = 8;
+
+    struct alignas(64) Bucket {
+      uint64_t entries[EntriesPerBucket];
+    };
+
+    uint64_t probes = 0;
+    uint64_t hits = 0;
+
+    EvalCache() = default;
+
+    EvalCache(const EvalCache&) = delete;
+    EvalCache& operator=(const EvalCache&) = delete;
+
+    ~EvalCache();
+
+    void resize(size_t megaBytes);
+
+    void clear();
+
+    size_t sizeBytes() const {
+      return bucketCount * sizeof(Bucket);
+    }
+
+    inline bool probe(Key key, Score& score) {
+      if (!buckets)
+        return false;
+
+      probes++;
+
+      const uint64_t* entries = buckets[key & (bucketCount - 1)].entries;
+      for (int i = 0; i < EntriesPerBucket; i++) {
+        if ((entries[i] ^ key) >> 16 == 0 && entries[i]) {
+          score = int16_t(entries[i]);
+          hits++;
+          return true;
+        }
+      }
+      return false;
+    }
+
+    // The newest entry goes first, the oldest one falls off the bucket
+    inline void store(Key key, Score score) {
+      if (!buckets)
+        return;
+
+      uint64_t* entries = buckets[key & (bucketCount - 1)].entries;
+      for (int i = EntriesPerBucket - 1; i > 0; i--)
+        entries[i] = entries[i - 1];
+
+      entries[0] = (key & ~0xFFFFULL) | uint16_t(score);
+    }
+
+  private:
+    Bucket* buckets = nullptr;
+    size_t bucketCount = 0;
+  };
+}
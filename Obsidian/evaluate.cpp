@@ -5,8 +5,10 @@
 namespace Eval {
 
   Score evaluate(Position& pos, NNUE::Accumulator& accumulator) {
+    return evaluate(pos, NNUE::evaluate(pos, accumulator));
+  }
 
-    Score score = NNUE::evaluate(pos, accumulator);
+  Score evaluate(Position& pos, Score score) {
 
     int phase =  3 * BitCount(pos.pieces(KNIGHT))
                + 3 * BitCount(pos.pieces(BISHOP))
@@ -6,4 +6,8 @@ namespace Eval {
 
   /// <returns> A value relative to the side to move </returns>
   Score evaluate(Position& pos, NNUE::Accumulator& accumulator);
+
+  /// Scales the raw network output (as returned by NNUE::evaluate) by game phase
+  /// <returns> A value relative to the side to move </returns>
+  Score evaluate(Position& pos, Score nnueScore);
 }
\ No newline at end of file
@@ -0,0 +1,121 @@
+#include "largepages.h"
+
+#include <cstdlib>
+#include <fstream>
+#include <new>
+#include <sstream>
+
+#if defined(__linux__)
+#include <sys/mman.h>
+#endif
+
+namespace LargePages {
+
+  constexpr size_t MEGA = 1024 * 1024;
+  constexpr size_t GIGA = 1024 * MEGA;
+
+  inline size_t roundUp(size_t bytes, size_t pageSize) {
+    return (bytes + pageSize - 1) / pageSize * pageSize;
+  }
+
+  size_t pageSize(Kind kind) {
+    switch (kind) {
+      case HUGE_1GB:    return GIGA;
+      case HUGE_2MB:
+      case TRANSPARENT: return 2 * MEGA;
+      default:          return 4096;
+    }
+  }
+
+#if defined(__linux__)
+
+  // MAP_HUGE_SHIFT and friends are missing from older headers
+  constexpr int HugeShift = 26;
+
+  void* mapHuge(size_t bytes, int log2PageSize) {
+    void* ptr = mmap(nullptr, bytes, PROT_READ | PROT_WRITE,
+                     MAP_PRIVATE | MAP_ANONYMOUS | MAP_HUGETLB | (log2PageSize << HugeShift), -1, 0);
+    return ptr == MAP_FAILED ? nullptr : ptr;
+  }
+
+  // madvise succeeds even when THP is disabled, so ask the kernel what it will do
+  bool transparentEnabled() {
+    std::ifstream file("/sys/kernel/mm/transparent_hugepage/enabled");
+    std::string setting;
+    std::getline(file, setting);
+    return file && setting.find("[never]") == std::string::npos;
+  }
+
+  Allocation allocate(size_t bytes) {
+    Allocation result;
+
+    // Not worth wasting up to a whole page on a small table
+    if (bytes >= GIGA) {
+      result.size = roundUp(bytes, GIGA);
+      if ((result.ptr = mapHuge(result.size, 30))) {
+        result.kind = HUGE_1GB;
+        return result;
+      }
+    }
+
+    result.size = roundUp(bytes, 2 * MEGA);
+    if ((result.ptr = mapHuge(result.size, 21))) {
+      result.kind = HUGE_2MB;
+      return result;
+    }
+
+    result.ptr = aligned_alloc(2 * MEGA, result.size);
+    result.kind = NORMAL;
+    if (result.ptr && madvise(result.ptr, result.size, MADV_HUGEPAGE) == 0 && transparentEnabled())
+      result.kind = TRANSPARENT;
+
+    return result;
+  }
+
+  void release(Allocation& allocation) {
+    if (!allocation.ptr)
+      return;
+
+    if (allocation.kind == HUGE_1GB || allocation.kind == HUGE_2MB)
+      munmap(allocation.ptr, allocation.size);
+    else
+      free(allocation.ptr);
+
+    allocation = Allocation();
+  }
+
+#else
+
+  Allocation allocate(size_t bytes) {
+    Allocation result;
+    result.size = roundUp(bytes, pageSize(NORMAL));
+    result.ptr = ::operator new(result.size, std::align_val_t(64), std::nothrow);
+    return result;
+  }
+
+  void release(Allocation& allocation) {
+    if (allocation.ptr)
+      ::operator delete(allocation.ptr, std::align_val_t(64));
+
+    allocation = Allocation();
+  }
+
+#endif
+
+  std::string describe(const Allocation& allocation) {
+    constexpr const char* Names[] = {
+      "4 KB pages", "transparent huge pages", "2 MB huge pages", "1 GB huge pages"
+    };
+
+    std::ostringstream ss;
+    ss << Names[allocation.kind] << " (" << allocation.size / pageSize(allocation.kind);
+
+    if (allocation.kind == TRANSPARENT)
+      ss << " pages of 2 MB if the kernel finds them";
+    else
+      ss << " pages";
+
+    ss << ")";
+    return ss.str();
+  }
+}
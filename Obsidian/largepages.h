@@ -0,0 +1,31 @@
+#pragma once
+
+#include "types.h"
+
+#include <string>
+
+namespace LargePages {
+
+  enum Kind {
+    NORMAL,       // Regular 4 KB pages
+    TRANSPARENT,  // Regular allocation, the kernel was asked to back it with huge pages
+    HUGE_2MB,     // Explicit huge pages (MAP_HUGETLB)
+    HUGE_1GB
+  };
+
+  struct Allocation {
+    void* ptr = nullptr;
+    size_t size = 0; // Rounded up to a whole number of pages
+    Kind kind = NORMAL;
+  };
+
+  /// Allocates at least the given amount of bytes, aligned to 64 bytes at least, trying in
+  /// order 1 GB and 2 MB explicit huge pages, transparent huge pages and normal pages.
+  /// The memory is not touched, so it gets placed by whoever first writes to it
+  Allocation allocate(size_t bytes);
+
+  void release(Allocation& allocation);
+
+  /// What the allocation ended up on, and how many TLB entries it takes to cover it
+  std::string describe(const Allocation& allocation);
+}
@@ -2,6 +2,7 @@
 //
 
 #include "cuckoo.h"
+#include "numa.h"
 #include "threads.h"
 #include "tt.h"
 #include "uci.h"
@@ -27,6 +28,8 @@ int main(int argc, char** argv)
 
   UCI::init(Options);
 
+  Numa::init();
+
   Threads::setThreadCount(Options["Threads"]);
   TT::resize(Options["Hash"]);
 
@@ -36,5 +39,7 @@ int main(int argc, char** argv)
 
   Threads::setThreadCount(0);
 
+  TT::release();
+
   return 0;
 }
\ No newline at end of file
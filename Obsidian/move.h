@@ -75,7 +75,7 @@ struct Move_Score {
 struct RootMove {
   Move move;
   int score;
-  int nodes;
+  uint64_t nodes;
 
   Move pv[MAX_PLY];
   int pvLength;
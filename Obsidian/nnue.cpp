@@ -1,23 +1,197 @@
 #include "nnue.h"
 #include "bitboard.h"
-#include "incbin.h"
+#include "largepages.h"
+#include "numa.h"
+#include "nnuekernels.h"
 #include "position.h"
 
+#if defined(USE_DISPATCH)
+// The embedded network must be aligned for the widest kernels, not for the baseline target
+#define INCBIN_ALIGNMENT_INDEX 6
+#endif
+
+#include "incbin.h"
+
+#include <algorithm>
+#include <cstddef>
 #include <iostream>
+#include <thread>
 #include <fstream>
+#include <type_traits>
+#include <vector>
+
+#if defined(_WIN32)
+#include <new>
+#else
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+#endif
 
 INCBIN(EmbeddedNNUE, EvalFile);
 
 namespace NNUE {
 
-  constexpr int WeightsPerVec = sizeof(Vec) / sizeof(weight_t);
-
-  struct {
-    alignas(Alignment) weight_t FeatureWeights[KingBuckets][2][6][64][HiddenWidth];
+  template<typename FeatureT>
+  struct NetworkData {
+    alignas(Alignment) FeatureT FeatureWeights[KingBuckets][2][6][64][HiddenWidth];
     alignas(Alignment) weight_t FeatureBiases[HiddenWidth];
     alignas(Alignment) weight_t OutputWeights[OutputBuckets][HiddenWidth];
                        weight_t OutputBias[OutputBuckets];
-  } Content;
+  };
+
+  using Network = NetworkData<weight_t>;
+
+  // Same network with 8 bit feature weights, which halves the memory traffic of the
+  // accumulator updates. Made out of a regular network by convertNetwork
+  using QuantisedNetwork = NetworkData<qweight_t>;
+
+  // Size of the weights in a file. The alignment of the members pads the structs at the
+  // end, and those padding bytes are not part of a network file
+  template<typename FeatureT>
+  constexpr size_t payloadSize() {
+    return offsetof(NetworkData<FeatureT>, OutputBias) + sizeof(NetworkData<FeatureT>::OutputBias);
+  }
+
+  constexpr size_t NetworkSize = payloadSize<weight_t>();
+  constexpr size_t QuantisedNetworkSize = payloadSize<qweight_t>();
+
+  // Optional header of an external network file. It is padded to 64 bytes,
+  // so that the weights which follow stay aligned for the SIMD kernels
+  struct alignas(64) NetworkHeader {
+    char magic[8];
+    uint64_t size;
+    uint64_t hash;
+  };
+
+  constexpr char NetworkMagic[8] = { 'O', 'B', 'S', 'N', 'N', 'U', 'E', '1' };
+
+  // Pointers to the parts of a network. Only one of Content and QuantisedContent is set,
+  // depending on the format of the network
+  struct NetworkView {
+    const Network* Content;
+    const QuantisedNetwork* QuantisedContent;
+
+    // The parts which are the same in both formats
+    const weight_t* FeatureBiases;
+    const weight_t (*OutputWeights)[HiddenWidth];
+    const weight_t* OutputBias;
+
+    template<typename FeatureT>
+    void use(const NetworkData<FeatureT>* net) {
+      if constexpr (std::is_same_v<FeatureT, qweight_t>) {
+        Content = nullptr;
+        QuantisedContent = net;
+      }
+      else {
+        Content = net;
+        QuantisedContent = nullptr;
+      }
+      FeatureBiases = net->FeatureBiases;
+      OutputWeights = net->OutputWeights;
+      OutputBias = net->OutputBias;
+    }
+  };
+
+  // The current network. It points either inside the executable (embedded network) or to a
+  // read-only mapping of an external file. In both cases the weights are never copied,
+  // and the pages are shared between all the engine processes using them
+  NetworkView mainNetwork;
+
+  // What each NUMA node uses: its own replica of the current network, or the same pointers
+  // as mainNetwork when there are no replicas
+  NetworkView nodeNetworks[Numa::MaxNodes];
+  LargePages::Allocation replicas[Numa::MaxNodes];
+  bool useReplicas = false;
+
+  // The network seen by the calling thread. Search threads bound to a node switch to the
+  // one of their node, every other thread stays on mainNetwork
+  thread_local const NetworkView* Net = &mainNetwork;
+
+  template<typename FeatureT>
+  void useNetwork(const NetworkData<FeatureT>* net) {
+    mainNetwork.use(net);
+  }
+
+  void* mappedFile = nullptr;
+  size_t mappedSize = 0;
+
+  // The weights as loaded (embedded or mapped), and an optional private copy of them on
+  // large pages. The copy trades the sharing between processes for fewer TLB misses
+  const void* sourceNetwork;
+  size_t sourceNetworkSize;
+  LargePages::Allocation networkCopy;
+  bool useLargePages = false;
+
+  // Gives every node its own copy of the network. Each copy is first written by a thread
+  // running on its node, so that the kernel places the pages there
+  void placeReplicas(const void* net, size_t size) {
+    for (int n = 0; n < Numa::MaxNodes; n++) {
+      LargePages::release(replicas[n]);
+      nodeNetworks[n] = mainNetwork;
+    }
+
+    if (!useReplicas || !Numa::isBinding() || Numa::nodeCount() < 2)
+      return;
+
+    std::vector<std::thread> threads;
+    for (int n = 0; n < Numa::nodeCount(); n++) {
+      threads.emplace_back([=] {
+        Numa::bindToNode(n);
+
+        LargePages::Allocation replica = LargePages::allocate(size);
+        if (!replica.ptr)
+          return;
+
+        memcpy(replica.ptr, net, size);
+        if (size == QuantisedNetworkSize)
+          nodeNetworks[n].use((const QuantisedNetwork*) replica.ptr);
+        else
+          nodeNetworks[n].use((const Network*) replica.ptr);
+        replicas[n] = replica;
+      });
+    }
+
+    for (std::thread& t : threads)
+      t.join();
+
+    std::cout << "info string Network replicated on " << Numa::nodeCount() << " NUMA nodes" << std::endl;
+  }
+
+  void placeNetwork(const void* net, size_t size) {
+    LargePages::release(networkCopy);
+    sourceNetwork = net;
+    sourceNetworkSize = size;
+
+    if (useLargePages) {
+      networkCopy = LargePages::allocate(size);
+      if (networkCopy.ptr) {
+        memcpy(networkCopy.ptr, net, size);
+        net = networkCopy.ptr;
+        std::cout << "info string Network copied to " << LargePages::describe(networkCopy) << std::endl;
+      }
+    }
+
+    if (size == QuantisedNetworkSize)
+      useNetwork((const QuantisedNetwork*) net);
+    else
+      useNetwork((const Network*) net);
+
+    placeReplicas(net, size);
+  }
+
+#if defined(USE_DISPATCH)
+  extern const KernelTable Avx2Kernels;
+  extern const KernelTable AvxVnniKernels;
+  extern const KernelTable Avx512Kernels;
+  extern const KernelTable Avx512VnniKernels;
+
+  // Starts with the baseline kernels, init() picks the best ones the cpu supports
+  KernelTable Kernels = LocalKernels;
+#else
+  constexpr KernelTable Kernels = LocalKernels;
+#endif
 
   bool needRefresh(Color side, Square oldKing, Square newKing) {
     // Crossed half?
@@ -28,131 +202,105 @@ namespace NNUE {
           != KingBucketsScheme[relative_square(side, newKing)];
   }
 
-  inline weight_t* featureAddress(Square kingSq, Color side, Piece pc, Square sq) {
+  template<typename FeatureT>
+  inline const FeatureT* featureAddress(const NetworkData<FeatureT>* net,
+                                        Square kingSq, Color side, Piece pc, Square sq) {
     if (kingSq & 0b100)
       sq = Square(sq ^ 7);
 
-    return Content.FeatureWeights
+    return net->FeatureWeights
             [KingBucketsScheme[relative_square(side, kingSq)]]
             [side != piece_color(pc)]
             [piece_type(pc)-1]
             [relative_square(side, sq)];
   }
 
-  template <int InputSize>
-  inline void multiAdd(weight_t* output, weight_t* input, weight_t* add0){
-    Vec* inputVec = (Vec*)input;
-    Vec* outputVec = (Vec*)output;
-    Vec* add0Vec = (Vec*) add0;
-
-    for (int i = 0; i < InputSize / WeightsPerVec; ++i)
-      outputVec[i] = addEpi16(inputVec[i], add0Vec[i]);
+  // Removes the given feature from the list and returns true, if it is there
+  inline bool cancel(SquarePiece* list, int& count, Piece pc, Square sq) {
+    for (int i = 0; i < count; i++) {
+      if (list[i].pc == pc && list[i].sq == sq) {
+        list[i] = list[--count];
+        return true;
+      }
+    }
+    return false;
   }
 
-  template <int InputSize>
-  inline void multiSub(weight_t* output, weight_t* input, weight_t* sub0){
-    Vec* inputVec = (Vec*)input;
-    Vec* outputVec = (Vec*)output;
-    Vec* sub0Vec = (Vec*) sub0;
+  void FeatureUpdates::addDirtyPieces(const DirtyPieces& dp) {
+    auto merge = [&](const SquarePiece& sub, const SquarePiece& add) {
+      if (!cancel(adds, addCount, sub.pc, sub.sq))
+        this->sub(sub.pc, sub.sq);
+      if (!cancel(subs, subCount, add.pc, add.sq))
+        this->add(add.pc, add.sq);
+    };
 
-    for (int i = 0; i < InputSize / WeightsPerVec; ++i)
-      outputVec[i] = subEpi16(inputVec[i], sub0Vec[i]);
-  }
+    merge(dp.sub0, dp.add0);
 
-  template <int InputSize>
-  inline void multiAddAdd(weight_t* output, weight_t* input, weight_t* add0, weight_t* add1){
-    Vec* inputVec = (Vec*)input;
-    Vec* outputVec = (Vec*)output;
-    Vec* add0Vec = (Vec*) add0;
-    Vec* add1Vec = (Vec*) add1;
-
-    for (int i = 0; i < InputSize / WeightsPerVec; ++i)
-      outputVec[i] = addEpi16(inputVec[i], addEpi16(add0Vec[i], add1Vec[i]));
+    if (dp.type == DirtyPieces::CAPTURE) {
+      if (!cancel(adds, addCount, dp.sub1.pc, dp.sub1.sq))
+        sub(dp.sub1.pc, dp.sub1.sq);
+    }
+    else if (dp.type == DirtyPieces::CASTLING)
+      merge(dp.sub1, dp.add1);
   }
 
-  template <int InputSize>
-  inline void multiSubAdd(weight_t* output, weight_t* input, weight_t* sub0, weight_t* add0) {
-    Vec* inputVec = (Vec*)input;
-    Vec* outputVec = (Vec*)output;
+  template<typename FeatureT, typename UpdateFn>
+  inline void applyRows(const NetworkData<FeatureT>* net, UpdateFn update, weight_t* output, const weight_t* input,
+                        Square kingSq, Color side, const FeatureUpdates& updates) {
+    const FeatureT* adds[FeatureUpdates::MaxUpdates];
+    const FeatureT* subs[FeatureUpdates::MaxUpdates];
 
-    Vec* sub0Vec = (Vec*) sub0;
-    Vec* add0Vec = (Vec*) add0;
+    for (int i = 0; i < updates.addCount; i++)
+      adds[i] = featureAddress(net, kingSq, side, updates.adds[i].pc, updates.adds[i].sq);
 
-    for (int i = 0; i < InputSize / WeightsPerVec; ++i)
-      outputVec[i] = subEpi16(addEpi16(inputVec[i], add0Vec[i]), sub0Vec[i]);
-  }
-
-  template <int InputSize>
-  inline void multiSubAddSub(weight_t* output, weight_t* input, weight_t* sub0, weight_t* add0, weight_t* sub1) {
-    Vec* inputVec = (Vec*)input;
-    Vec* outputVec = (Vec*)output;
-
-    Vec* sub0Vec = (Vec*) sub0;
-    Vec* add0Vec = (Vec*) add0;
-    Vec* sub1Vec = (Vec*) sub1;
+    for (int i = 0; i < updates.subCount; i++)
+      subs[i] = featureAddress(net, kingSq, side, updates.subs[i].pc, updates.subs[i].sq);
 
-    for (int i = 0; i < InputSize / WeightsPerVec; ++i)
-      outputVec[i] = subEpi16(subEpi16(addEpi16(inputVec[i], add0Vec[i]), sub0Vec[i]), sub1Vec[i]);
+    update(output, input, adds, updates.addCount, subs, updates.subCount);
   }
 
-   template <int InputSize>
-  inline void multiSubAddSubAdd(weight_t* output, weight_t* input, weight_t* sub0, weight_t* add0, weight_t* sub1, weight_t* add1) {
-    Vec* inputVec = (Vec*)input;
-    Vec* outputVec = (Vec*)output;
-
-    Vec* sub0Vec = (Vec*) sub0;
-    Vec* add0Vec = (Vec*) add0;
-    Vec* sub1Vec = (Vec*) sub1;
-    Vec* add1Vec = (Vec*) add1;
-
-    for (int i = 0; i < InputSize / WeightsPerVec; ++i)
-      outputVec[i] = addEpi16(subEpi16(subEpi16(addEpi16(inputVec[i], add0Vec[i]), sub0Vec[i]), sub1Vec[i]), add1Vec[i]);
+  // Applies all the updates to the input, and writes the result to output (which may alias input)
+  void applyFeatures(weight_t* output, const weight_t* input,
+                     Square kingSq, Color side, const FeatureUpdates& updates) {
+    if (Net->QuantisedContent)
+      applyRows(Net->QuantisedContent, Kernels.updateQuantised, output, input, kingSq, side, updates);
+    else
+      applyRows(Net->Content, Kernels.update, output, input, kingSq, side, updates);
   }
 
-  void Accumulator::addPiece(Square kingSq, Color side, Piece pc, Square sq) {
-    multiAdd<HiddenWidth>(colors[side], colors[side], featureAddress(kingSq, side, pc, sq));
-  }
-
-  void Accumulator::removePiece(Square kingSq, Color side, Piece pc, Square sq) {
-    multiSub<HiddenWidth>(colors[side], colors[side], featureAddress(kingSq, side, pc, sq));
+  void Accumulator::applyUpdates(Square kingSq, Color side, const Accumulator& input, const FeatureUpdates& updates) {
+    applyFeatures(colors[side], input.colors[side], kingSq, side, updates);
+    updated[side] = true;
   }
 
   void Accumulator::doUpdates(Square kingSq, Color side, Accumulator& input) {
     DirtyPieces dp = this->dirtyPieces;
+    FeatureUpdates updates;
+
+    updates.sub(dp.sub0.pc, dp.sub0.sq);
+    updates.add(dp.add0.pc, dp.add0.sq);
+
+    if (dp.type != DirtyPieces::NORMAL)
+      updates.sub(dp.sub1.pc, dp.sub1.sq);
+
     if (dp.type == DirtyPieces::CASTLING)
-    {
-      multiSubAddSubAdd<HiddenWidth>(colors[side], input.colors[side],
-        featureAddress(kingSq, side, dp.sub0.pc, dp.sub0.sq),
-        featureAddress(kingSq, side, dp.add0.pc, dp.add0.sq),
-        featureAddress(kingSq, side, dp.sub1.pc, dp.sub1.sq),
-        featureAddress(kingSq, side, dp.add1.pc, dp.add1.sq));
-    } else if (dp.type == DirtyPieces::CAPTURE)
-    {
-      multiSubAddSub<HiddenWidth>(colors[side], input.colors[side],
-        featureAddress(kingSq, side, dp.sub0.pc, dp.sub0.sq),
-        featureAddress(kingSq, side, dp.add0.pc, dp.add0.sq),
-        featureAddress(kingSq, side, dp.sub1.pc, dp.sub1.sq));
-    } else
-    {
-      multiSubAdd<HiddenWidth>(colors[side], input.colors[side],
-        featureAddress(kingSq, side, dp.sub0.pc, dp.sub0.sq),
-        featureAddress(kingSq, side, dp.add0.pc, dp.add0.sq));
-    }
-    updated[side] = true;
+      updates.add(dp.add1.pc, dp.add1.sq);
+
+    applyUpdates(kingSq, side, input, updates);
   }
 
   void Accumulator::reset(Color side) {
-    memcpy(colors[side], Content.FeatureBiases, sizeof(Content.FeatureBiases));
+    memcpy(colors[side], Net->FeatureBiases, sizeof(colors[side]));
   }
 
   void Accumulator::refresh(Position& pos, Color side) {
-    reset(side);
-    const Square kingSq = pos.kingSquare(side);
+    FeatureUpdates updates;
     Bitboard occupied = pos.pieces();
     while (occupied) {
       const Square sq = popLsb(occupied);
-      addPiece(kingSq, side, pos.board[sq], sq);
+      updates.add(pos.board[sq], sq);
     }
+    applyFeatures(colors[side], Net->FeatureBiases, pos.kingSquare(side), side, updates);
     updated[side] = true;
   }
 
@@ -163,38 +311,366 @@ namespace NNUE {
     acc.reset(BLACK);
   }
 
-  void init() {
+  void FinnyEntry::update(Position& pos, Square kingSq, Color side) {
+    FeatureUpdates updates;
 
-    memcpy(&Content, gEmbeddedNNUEData, sizeof(Content));
+    for (Color c = WHITE; c <= BLACK; ++c) {
+      for (PieceType pt = PAWN; pt <= KING; ++pt) {
+        const Bitboard oldBB = byColorBB[side][c] & byPieceBB[side][pt];
+        const Bitboard newBB = pos.pieces(c, pt);
+        Bitboard toRemove = oldBB & ~newBB;
+        Bitboard toAdd = newBB & ~oldBB;
 
+        while (toRemove)
+          updates.sub(makePiece(c, pt), popLsb(toRemove));
+        while (toAdd)
+          updates.add(makePiece(c, pt), popLsb(toAdd));
+      }
+    }
+
+    // Unrelated positions can be further apart than from an empty board
+    if (updates.addCount + updates.subCount > BitCount(pos.pieces())) {
+      FeatureUpdates all;
+      Bitboard occupied = pos.pieces();
+      while (occupied) {
+        const Square sq = popLsb(occupied);
+        all.add(pos.board[sq], sq);
+      }
+      applyFeatures(acc.colors[side], Net->FeatureBiases, kingSq, side, all);
+    }
+    else
+      applyFeatures(acc.colors[side], acc.colors[side], kingSq, side, updates);
+
+    memcpy(byColorBB[side], pos.byColorBB, sizeof(byColorBB[0]));
+    memcpy(byPieceBB[side], pos.byPieceBB, sizeof(byPieceBB[0]));
   }
 
-  Score evaluate(Position& pos, Accumulator& accumulator) {
+  uint64_t hashNetwork(const void* net, size_t size) {
+    const uint64_t* words = (const uint64_t*) net;
+    const size_t count = size / sizeof(uint64_t);
+
+    // 64 bit FNV-1a, one word at a time
+    uint64_t hash = 0xcbf29ce484222325ULL;
+    for (size_t i = 0; i < count; i++)
+      hash = (hash ^ words[i]) * 0x100000001b3ULL;
+    return hash;
+  }
+
+  bool isNetworkSize(size_t size) {
+    return size == NetworkSize || size == QuantisedNetworkSize;
+  }
+
+  void unmapFile(void* data, size_t size) {
+    if (!data)
+      return;
+
+#if defined(_WIN32)
+    ::operator delete(data, std::align_val_t(64));
+#else
+    munmap(data, size);
+#endif
+  }
+
+  void* mapFile(const std::string& path, size_t& size) {
+#if defined(_WIN32)
+    std::ifstream file(path, std::ios::binary | std::ios::ate);
+    if (!file)
+      return nullptr;
+
+    size = file.tellg();
+    file.seekg(0);
+
+    char* data = (char*) ::operator new(size, std::align_val_t(64));
+    if (!file.read(data, size)) {
+      ::operator delete(data, std::align_val_t(64));
+      return nullptr;
+    }
+    return data;
+#else
+    int fd = open(path.c_str(), O_RDONLY);
+    if (fd == -1)
+      return nullptr;
+
+    struct stat st;
+    if (fstat(fd, &st) == -1 || st.st_size == 0) {
+      close(fd);
+      return nullptr;
+    }
+    size = st.st_size;
+
+    void* data = mmap(nullptr, size, PROT_READ, MAP_SHARED, fd, 0);
+    close(fd);
+
+    return data == MAP_FAILED ? nullptr : data;
+#endif
+  }
+
+  bool loadEvalFile(const std::string& path) {
+
+    if (path.empty()) {
+      placeNetwork(gEmbeddedNNUEData, NetworkSize);
+      unmapFile(mappedFile, mappedSize);
+      mappedFile = nullptr;
+      return true;
+    }
+
+    size_t size;
+    void* data = mapFile(path, size);
+
+    if (!data) {
+      std::cout << "info string EvalFile " << path << " could not be opened" << std::endl;
+      return false;
+    }
 
+    // The format is told by the size of the weights
+    const void* net = nullptr;
+    size_t netSize = 0;
+    const NetworkHeader* header = (const NetworkHeader*) data;
+
+    if (isNetworkSize(size))
+      net = data, netSize = size;
+    else if ( size > sizeof(NetworkHeader)
+           && memcmp(header->magic, NetworkMagic, sizeof(NetworkMagic)) == 0
+           && header->size == size - sizeof(NetworkHeader)
+           && isNetworkSize(header->size))
+      net = header + 1, netSize = header->size;
+
+    const uint64_t hash = net ? hashNetwork(net, netSize) : 0;
+
+    // Files without a header can only be checked by their size
+    if (!net || (net != data && hash != header->hash)) {
+      std::cout << "info string EvalFile " << path << " is not a valid network" << std::endl;
+      unmapFile(data, size);
+      return false;
+    }
+
+    unmapFile(mappedFile, mappedSize);
+    mappedFile = data;
+    mappedSize = size;
+
+    placeNetwork(net, netSize);
+
+    std::cout << "info string EvalFile " << path << " loaded, hash "
+              << std::hex << hash << std::dec
+              << (mainNetwork.QuantisedContent ? ", 8 bit feature weights" : "") << std::endl;
+    return true;
+  }
+
+  void setLargePages(bool enabled) {
+    useLargePages = enabled;
+    placeNetwork(sourceNetwork, sourceNetworkSize);
+  }
+
+  void setReplication(bool enabled) {
+    useReplicas = enabled;
+    placeNetwork(sourceNetwork, sourceNetworkSize);
+  }
+
+  void useNodeNetwork(int node) {
+    Net = node >= 0 ? &nodeNetworks[node] : &mainNetwork;
+  }
+
+  bool convertNetwork(const std::string& path, Position* positions, int count) {
+
+    if (!mainNetwork.Content) {
+      std::cout << "info string The current network is already quantised" << std::endl;
+      return false;
+    }
+
+    const Network* source = mainNetwork.Content;
+    QuantisedNetwork* quantised = new QuantisedNetwork;
+
+    // Weights outside of the 8 bit range are clamped, the evaluation report below
+    // tells whether that matters
+    const weight_t* weights = &source->FeatureWeights[0][0][0][0][0];
+    qweight_t* qweights = &quantised->FeatureWeights[0][0][0][0][0];
+    const size_t weightCount = sizeof(source->FeatureWeights) / sizeof(weight_t);
+    size_t clamped = 0;
+
+    for (size_t i = 0; i < weightCount; i++) {
+      const weight_t w = std::clamp<weight_t>(weights[i], INT8_MIN, INT8_MAX);
+      clamped += w != weights[i];
+      qweights[i] = qweight_t(w);
+    }
+
+    memcpy(quantised->FeatureBiases, source->FeatureBiases, sizeof(source->FeatureBiases));
+    memcpy(quantised->OutputWeights, source->OutputWeights, sizeof(source->OutputWeights));
+    memcpy(quantised->OutputBias, source->OutputBias, sizeof(source->OutputBias));
+
+    NetworkHeader header = {};
+    memcpy(header.magic, NetworkMagic, sizeof(NetworkMagic));
+    header.size = QuantisedNetworkSize;
+    header.hash = hashNetwork(quantised, QuantisedNetworkSize);
+
+    std::ofstream file(path, std::ios::binary);
+    file.write((const char*) &header, sizeof(header));
+    file.write((const char*) quantised, QuantisedNetworkSize);
+
+    if (!file) {
+      std::cout << "info string Could not write " << path << std::endl;
+      delete quantised;
+      return false;
+    }
+
+    std::cout << "info string Wrote " << path << ", hash " << std::hex << header.hash << std::dec
+              << ", " << clamped << " of " << weightCount << " feature weights clamped" << std::endl;
+
+    // Evaluate the positions with both networks, from scratch
+    int64_t totalDiff = 0;
+    int maxDiff = 0, changed = 0;
+
+    for (int i = 0; i < count; i++) {
+      Score scores[2];
+
+      for (int q = 0; q < 2; q++) {
+        if (q)
+          useNetwork((const QuantisedNetwork*) quantised);
+
+        Accumulator acc;
+        acc.refresh(positions[i], WHITE);
+        acc.refresh(positions[i], BLACK);
+        scores[q] = evaluate(positions[i], acc);
+      }
+      useNetwork(source);
+
+      const int diff = std::abs(scores[1] - scores[0]);
+      totalDiff += diff;
+      maxDiff = std::max(maxDiff, diff);
+      changed += diff != 0;
+    }
+
+    std::cout << "info string Evaluation difference over " << count << " positions: "
+              << changed << " changed, mean " << double(totalDiff) / std::max(count, 1)
+              << ", max " << maxDiff << std::endl;
+
+    delete quantised;
+    return true;
+  }
+
+  std::vector<const KernelTable*> supportedKernels() {
+    std::vector<const KernelTable*> result;
+
+#if defined(USE_DISPATCH)
+    __builtin_cpu_init();
+
+    const bool avx512 = __builtin_cpu_supports("avx512f") && __builtin_cpu_supports("avx512bw");
+    const bool avx2 = __builtin_cpu_supports("avx2");
+
+    if (avx512 && __builtin_cpu_supports("avx512vnni"))
+      result.push_back(&Avx512VnniKernels);
+    if (avx512)
+      result.push_back(&Avx512Kernels);
+    if (avx2 && __builtin_cpu_supports("avxvnni"))
+      result.push_back(&AvxVnniKernels);
+    if (avx2)
+      result.push_back(&Avx2Kernels);
+
+    result.push_back(&LocalKernels);
+#else
+    result.push_back(&Kernels);
+#endif
+
+    return result;
+  }
+
+  void init() {
+
+#if defined(USE_DISPATCH)
+    Kernels = *supportedKernels()[0];
+
+    std::cout << "info string Using " << Kernels.name << " NNUE kernels" << std::endl;
+#endif
+
+    loadEvalFile("");
+
+  }
+
+  inline int outputBucket(const Position& pos) {
     constexpr int divisor = (32 + OutputBuckets - 1) / OutputBuckets;
-    int outputBucket = (BitCount(pos.pieces()) - 2) / divisor;
-
-    Vec vecZero = vecSetZero();
-    Vec vecQA = vecSet1Epi16(NetworkQA);
-
-    Vec sum = vecZero;
-
-    for (int them = 0; them <= 1; ++them)
-    {
-      Vec* acc = (Vec*) accumulator.colors[pos.sideToMove ^ them];
-      Vec* weights = (Vec*) &Content.OutputWeights[outputBucket][them * HiddenWidth / 2];
-      for (int i = 0; i < (HiddenWidth / WeightsPerVec) / 2; ++i)
-      {
-        Vec c0 = minEpi16(maxEpi16(acc[i], vecZero), vecQA);
-        Vec c1 = minEpi16(maxEpi16(acc[i + (HiddenWidth / WeightsPerVec) / 2], vecZero), vecQA);
-        Vec prod = maddEpi16(mulloEpi16(c0, weights[i]), c1);
-        sum = addEpi32(sum, prod);
+    return (BitCount(pos.pieces()) - 2) / divisor;
+  }
+
+  void benchOutput(Position* positions, int count) {
+
+    constexpr int Evaluations = 1 << 22;
+
+    std::vector<Accumulator> accumulators(count);
+    for (int i = 0; i < count; i++) {
+      accumulators[i].refresh(positions[i], WHITE);
+      accumulators[i].refresh(positions[i], BLACK);
+    }
+
+    for (const KernelTable* table : supportedKernels()) {
+      int64_t sink = 0;
+      int64_t begin = timeMillis();
+
+      for (int n = 0; n < Evaluations; n++) {
+        Position& pos = positions[n % count];
+        Accumulator& acc = accumulators[n % count];
+        sink += table->output(acc.colors[pos.sideToMove],
+                              acc.colors[~pos.sideToMove],
+                              Net->OutputWeights[outputBucket(pos)]);
       }
+
+      int64_t took = std::max<int64_t>(timeMillis() - begin, 1);
+
+      std::cout << table->name << ": " << (Evaluations * 1000LL / took) << " evals/s"
+                << " (checksum " << sink << ")" << std::endl;
     }
+  }
 
-    int unsquared = vecHaddEpi32(sum) / NetworkQA + Content.OutputBias[outputBucket];
+  Score outputScore(Position& pos, const weight_t* us, const weight_t* them) {
+
+    const int bucket = outputBucket(pos);
+
+    int sum = Kernels.output(us, them, Net->OutputWeights[bucket]);
+
+    int unsquared = sum / NetworkQA + Net->OutputBias[bucket];
 
     return (unsquared * NetworkScale) / NetworkQAB;
   }
 
+  Score evaluate(Position& pos, Accumulator& accumulator) {
+    return outputScore(pos, accumulator.colors[pos.sideToMove], accumulator.colors[~pos.sideToMove]);
+  }
+
+  // Index of the refresh table entry used by the given king, as a flat [2][KingBuckets]
+  inline int finnySlot(Color side, Square king) {
+    return (fileOf(king) >= FILE_E) * KingBuckets + KingBucketsScheme[relative_square(side, king)];
+  }
+
+  void evaluateBatch(Position* positions, Score* scores, int count) {
+
+    std::vector<FinnyEntry> table(2 * KingBuckets);
+    for (FinnyEntry& entry : table)
+      entry.reset();
+
+    auto slots = [&](int i) {
+      Position& pos = positions[i];
+      return finnySlot(WHITE, pos.kingSquare(WHITE)) * 2 * KingBuckets
+           + finnySlot(BLACK, pos.kingSquare(BLACK));
+    };
+
+    std::vector<int> order(count);
+    for (int i = 0; i < count; i++)
+      order[i] = i;
+
+    // Stable, so that consecutive (likely similar) positions of the input stay together
+    std::stable_sort(order.begin(), order.end(), [&](int a, int b) { return slots(a) < slots(b); });
+
+    for (int i : order) {
+      Position& pos = positions[i];
+      FinnyEntry* entries[COLOR_NB];
+
+      for (Color side = WHITE; side <= BLACK; ++side) {
+        const Square king = pos.kingSquare(side);
+        entries[side] = &table[finnySlot(side, king)];
+        entries[side]->update(pos, king, side);
+      }
+
+      scores[i] = outputScore(pos, entries[pos.sideToMove]->acc.colors[pos.sideToMove],
+                                   entries[~pos.sideToMove]->acc.colors[~pos.sideToMove]);
+    }
+  }
+
 }
@@ -1,11 +1,10 @@
 #pragma once
 
-#include "simd.h"
 #include "types.h"
 
-#define EvalFile "net53.bin"
+#include <string>
 
-using namespace SIMD;
+#define EvalFile "net53.bin"
 
 struct Position;
 
@@ -26,6 +25,9 @@ namespace NNUE {
 
   using weight_t = int16_t;
 
+  // Feature weights of quantised networks, widened to weight_t when accumulated
+  using qweight_t = int8_t;
+
   constexpr int FeaturesWidth = 768;
   constexpr int HiddenWidth = 1536;
 
@@ -48,6 +50,49 @@ namespace NNUE {
   constexpr int NetworkQB = 64;
   constexpr int NetworkQAB = NetworkQA * NetworkQB;
 
+  // Enough for the widest SIMD vector, whatever kernels get selected at runtime
+  constexpr int Alignment = 64;
+
+  // The SIMD routines of the network. Each instruction set has its own table (see nnuekernels.h)
+  struct KernelTable {
+    const char* name;
+
+    /// output = input + sum(adds) - sum(subs), over a whole accumulator row
+    void (*update)(weight_t* output, const weight_t* input,
+                   const weight_t* const* adds, int addCount,
+                   const weight_t* const* subs, int subCount);
+
+    /// Same as update, for the 8 bit feature rows of quantised networks
+    void (*updateQuantised)(weight_t* output, const weight_t* input,
+                            const qweight_t* const* adds, int addCount,
+                            const qweight_t* const* subs, int subCount);
+
+    /// Returns the output layer sum, before the QA division
+    int (*output)(const weight_t* us, const weight_t* them, const weight_t* weights);
+  };
+
+  // Features to add to and remove from an accumulator, all applied in a single pass.
+  // No more than 32 pieces can appear or disappear between two positions
+  struct FeatureUpdates {
+    static constexpr int MaxUpdates = 32;
+
+    SquarePiece adds[MaxUpdates], subs[MaxUpdates];
+    int addCount = 0, subCount = 0;
+
+    inline void add(Piece pc, Square sq) {
+      adds[addCount++] = { sq, pc };
+    }
+
+    inline void sub(Piece pc, Square sq) {
+      subs[subCount++] = { sq, pc };
+    }
+
+    /// Appends the changes of one more move. A feature that was added by an earlier move
+    /// and is removed by this one (or vice versa) cancels out, so that the lists always
+    /// hold the net difference between the first and the last position
+    void addDirtyPieces(const DirtyPieces& dp);
+  };
+
   struct Accumulator {
 
     alignas(Alignment) weight_t colors[COLOR_NB][HiddenWidth];
@@ -56,9 +101,7 @@ namespace NNUE {
     Square kings[COLOR_NB];
     DirtyPieces dirtyPieces;
 
-    void addPiece(Square kingSq, Color side, Piece pc, Square sq);
-
-    void removePiece(Square kingSq, Color side, Piece pc, Square sq);
+    void applyUpdates(Square kingSq, Color side, const Accumulator& input, const FeatureUpdates& updates);
 
     void doUpdates(Square kingSq, Color side, Accumulator& input);
 
@@ -73,6 +116,10 @@ namespace NNUE {
     Accumulator acc;
 
     void reset();
+
+    /// Brings the accumulator of the given side up to date with the pieces of the position.
+    /// The king square only selects the bucket, it doesn't need to be the one on the board
+    void update(Position& pos, Square kingSq, Color side);
   };
 
   using FinnyTable = FinnyEntry[2][KingBuckets];
@@ -81,5 +128,32 @@ namespace NNUE {
 
   void init();
 
+  /// Switches to the network in the given file, or to the embedded one if the path is empty.
+  /// The file is mapped read-only; on failure the current network is kept
+  bool loadEvalFile(const std::string& path);
+
+  /// Whether the weights get copied to a private large page allocation. The copy is
+  /// made again whenever a network is loaded
+  void setLargePages(bool enabled);
+
+  /// Whether every NUMA node gets its own copy of the weights, used by the search threads
+  /// bound to that node. Only done when threads are bound and there are several nodes
+  void setReplication(bool enabled);
+
+  /// Makes the calling thread use the network of the given node, or the shared one if -1
+  void useNodeNetwork(int node);
+
+  /// Writes the current network to the given file with its feature weights quantised to
+  /// 8 bits, and reports how much the evaluation of the given positions changes
+  bool convertNetwork(const std::string& path, Position* positions, int count);
+
   Score evaluate(Position& pos, Accumulator& accumulator);
+
+  /// Evaluates many unrelated positions (scores are relative to the side to move).
+  /// Positions are visited grouped by king buckets, and each one is reached from the previous
+  /// one in the same bucket with a diff, so most weight rows are loaded once per group
+  void evaluateBatch(Position* positions, Score* scores, int count);
+
+  /// Measures the speed of the output layer with every kernel table this cpu supports
+  void benchOutput(Position* positions, int count);
 }
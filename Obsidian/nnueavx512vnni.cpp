@@ -0,0 +1,23 @@
+// AVX-512 VNNI kernels of the network, selected at startup by fat binaries (build=fat)
+
+#if defined(USE_DISPATCH)
+
+// Anything that could be shared with the other translation units is included
+// before raising the target, so that it only exists in its baseline form
+#include "nnue.h"
+
+#include <immintrin.h>
+
+#pragma GCC target("popcnt,ssse3,sse4.1,bmi,fma,avx2,avx512f,avx512bw,avx512vnni")
+
+#define SIMD_AVX512
+#define SIMD_VNNI
+#include "nnuekernels.h"
+
+namespace NNUE {
+
+  extern const KernelTable Avx512VnniKernels = LocalKernels;
+
+}
+
+#endif
@@ -0,0 +1,103 @@
+#pragma once
+
+#include "nnue.h"
+#include "simd.h"
+
+namespace NNUE {
+
+  // Fat binaries compile this header once per instruction set (see nnueavx2.cpp,
+  // nnueavx512.cpp and their VNNI variants), so everything in here must have internal linkage
+  namespace {
+
+    using namespace SIMD;
+
+    constexpr int WeightsPerVec = sizeof(Vec) / sizeof(weight_t);
+
+    // How many vectors of the accumulator are kept in registers while all
+    // the pending features are applied to them
+    constexpr int TileRegs = sizeof(Vec) == 64 ? 16 : 12;
+
+    // Loads the index-th vector of a feature row, widening quantised weights on the fly
+    inline Vec loadRow(const weight_t* row, int index) {
+      return ((const Vec*) row)[index];
+    }
+
+    inline Vec loadRow(const qweight_t* row, int index) {
+      return loadEpi8AsEpi16(row + index * WeightsPerVec);
+    }
+
+    template <int InputSize, typename FeatureT>
+    void multiUpdate(weight_t* output, const weight_t* input,
+                     const FeatureT* const* adds, int addCount,
+                     const FeatureT* const* subs, int subCount)
+    {
+      constexpr int VecCount = InputSize / WeightsPerVec;
+      static_assert(VecCount % TileRegs == 0 && VecCount / TileRegs <= 16);
+
+      // Fully unrolled, so that the tile offsets fold into the addressing
+#pragma GCC unroll 16
+      for (int tile = 0; tile < VecCount; tile += TileRegs) {
+        Vec regs[TileRegs];
+
+        const Vec* inputVec = (const Vec*) input + tile;
+        for (int i = 0; i < TileRegs; ++i)
+          regs[i] = inputVec[i];
+
+        for (int f = 0; f < addCount; ++f) {
+          for (int i = 0; i < TileRegs; ++i)
+            regs[i] = addEpi16(regs[i], loadRow(adds[f], tile + i));
+        }
+
+        for (int f = 0; f < subCount; ++f) {
+          for (int i = 0; i < TileRegs; ++i)
+            regs[i] = subEpi16(regs[i], loadRow(subs[f], tile + i));
+        }
+
+        Vec* outputVec = (Vec*) output + tile;
+        for (int i = 0; i < TileRegs; ++i)
+          outputVec[i] = regs[i];
+      }
+    }
+
+    // dpwssd has a latency of several cycles: with a single sum, each step would wait for
+    // the previous one. Independent sums keep the pipeline busy, and get added at the end
+    constexpr int OutputSums = 4;
+
+    int screluOutput(const weight_t* us, const weight_t* them, const weight_t* weights) {
+
+      constexpr int HalfVecs = (HiddenWidth / WeightsPerVec) / 2;
+      static_assert(HalfVecs % OutputSums == 0);
+
+      Vec vecZero = vecSetZero();
+      Vec vecQA = vecSet1Epi16(NetworkQA);
+
+      Vec sums[OutputSums];
+      for (int j = 0; j < OutputSums; ++j)
+        sums[j] = vecZero;
+
+      for (int side = 0; side <= 1; ++side)
+      {
+        const Vec* acc = (const Vec*) (side ? them : us);
+        const Vec* weightsVec = (const Vec*) &weights[side * HiddenWidth / 2];
+        for (int i = 0; i < HalfVecs; i += OutputSums)
+        {
+          for (int j = 0; j < OutputSums; ++j) {
+            Vec c0 = minEpi16(maxEpi16(acc[i + j], vecZero), vecQA);
+            Vec c1 = minEpi16(maxEpi16(acc[i + j + HalfVecs], vecZero), vecQA);
+            sums[j] = dpwssdEpi32(sums[j], mulloEpi16(c0, weightsVec[i + j]), c1);
+          }
+        }
+      }
+
+      Vec sum = addEpi32(addEpi32(sums[0], sums[1]), addEpi32(sums[2], sums[3]));
+      return vecHaddEpi32(sum);
+    }
+
+    constexpr KernelTable LocalKernels = {
+      ArchName,
+      multiUpdate<HiddenWidth, weight_t>,
+      multiUpdate<HiddenWidth, qweight_t>,
+      screluOutput
+    };
+  }
+}
@@ -0,0 +1,132 @@
+#include "numa.h"
+
+#include <fstream>
+#include <sstream>
+#include <vector>
+
+#if defined(__linux__)
+#include <sched.h>
+#endif
+
+namespace Numa {
+
+  // CPUs of every node which has any, in the order the kernel lists them
+  std::vector<std::vector<int>> nodes;
+
+  bool binding = false;
+
+#if defined(__linux__)
+
+  // Parses a kernel cpu list such as "0-13,28-41"
+  std::vector<int> parseCpuList(const std::string& list) {
+    std::vector<int> result;
+    std::istringstream ss(list);
+    std::string range;
+
+    while (std::getline(ss, range, ',')) {
+      if (range.empty())
+        continue;
+
+      const size_t dash = range.find('-');
+      const int first = std::stoi(range.substr(0, dash));
+      const int last = dash == std::string::npos ? first : std::stoi(range.substr(dash + 1));
+      for (int cpu = first; cpu <= last; cpu++)
+        result.push_back(cpu);
+    }
+    return result;
+  }
+
+  void init() {
+    nodes.clear();
+
+    cpu_set_t allowed;
+    CPU_ZERO(&allowed);
+    const bool knowAllowed = sched_getaffinity(0, sizeof(allowed), &allowed) == 0;
+
+    // Node numbers may have holes
+    for (int n = 0; n < 1024 && nodes.size() < MaxNodes; n++) {
+      std::ifstream file("/sys/devices/system/node/node" + std::to_string(n) + "/cpulist");
+      std::string list;
+      if (!std::getline(file, list))
+        continue;
+
+      std::vector<int> cpus;
+      for (int cpu : parseCpuList(list))
+        if (!knowAllowed || (cpu < CPU_SETSIZE && CPU_ISSET(cpu, &allowed)))
+          cpus.push_back(cpu);
+
+      // Memory-only nodes, or nodes this process is kept away from
+      if (!cpus.empty())
+        nodes.push_back(cpus);
+    }
+
+    if (nodes.empty()) {
+      std::vector<int> cpus;
+      for (int cpu = 0; cpu < CPU_SETSIZE; cpu++)
+        if (knowAllowed && CPU_ISSET(cpu, &allowed))
+          cpus.push_back(cpu);
+      nodes.push_back(cpus);
+    }
+  }
+
+  void pin(const std::vector<int>& cpus) {
+    cpu_set_t set;
+    CPU_ZERO(&set);
+    for (int cpu : cpus)
+      CPU_SET(cpu, &set);
+    sched_setaffinity(0, sizeof(set), &set);
+  }
+
+#else
+
+  void init() {
+    nodes.assign(1, std::vector<int>());
+  }
+
+  void pin(const std::vector<int>&) { }
+
+#endif
+
+  int nodeCount() {
+    return int(nodes.size());
+  }
+
+  void setBinding(bool enabled) {
+    binding = enabled;
+  }
+
+  bool isBinding() {
+    return binding;
+  }
+
+  int nodeOfThread(int index) {
+    return index % nodeCount();
+  }
+
+  int bindThread(int index) {
+    if (!binding)
+      return -1;
+
+    const int node = nodeOfThread(index);
+    const std::vector<int>& cpus = nodes[node];
+
+    // More threads than cores share them, in the same order
+    if (!cpus.empty())
+      pin({ cpus[(index / nodeCount()) % cpus.size()] });
+
+    return node;
+  }
+
+  void bindToNode(int node) {
+    pin(nodes[node]);
+  }
+
+  std::string describe() {
+    std::ostringstream ss;
+    ss << nodeCount() << (nodeCount() == 1 ? " NUMA node" : " NUMA nodes") << " (";
+    for (int n = 0; n < nodeCount(); n++)
+      ss << (n ? ", " : "") << nodes[n].size();
+    ss << " cores)";
+    return ss.str();
+  }
+}
@@ -0,0 +1,34 @@
+#pragma once
+
+#include "types.h"
+
+#include <string>
+
+namespace Numa {
+
+  constexpr int MaxNodes = 64;
+
+  /// Reads which CPUs belong to which NUMA node, keeping only the ones this process may run on.
+  /// Without a topology (or outside Linux) all the CPUs form a single node
+  void init();
+
+  int nodeCount();
+
+  /// Whether search threads get pinned to cores. Threads have to be recreated to follow
+  void setBinding(bool enabled);
+
+  bool isBinding();
+
+  /// Node of the core search thread `index` runs on. Threads are spread evenly over the
+  /// nodes, and over the cores of each node in the order the kernel lists them
+  int nodeOfThread(int index);
+
+  /// Pins the calling thread to the core of search thread `index`, so that the memory it
+  /// touches first is placed on the local node. Returns the node, or -1 if binding is off
+  int bindThread(int index);
+
+  /// Pins the calling thread to all the cores of a node
+  void bindToNode(int node);
+
+  std::string describe();
+}
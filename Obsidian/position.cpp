@@ -403,23 +403,85 @@ void Position::calcThreats(Threats& threats) {
   }
 }
 
-/// Only works for MT_NORMAL moves
+/// The key doMove would give, for any move type (castling, en passant and promotions included)
 Key Position::keyAfter(Move move) const {
 
-  Key newKey = key;
+  const Color us = sideToMove, them = ~us;
+
+  Key newKey = key ^ ZOBRIST_TEMPO;
+
+  if (epSquare != SQ_NONE)
+    newKey ^= ZOBRIST_EP[fileOf(epSquare)];
+
+  CastlingRights newCastlingRights = castlingRights;
 
   const Square from = move_from(move);
   const Square to = move_to(move);
 
-  const Piece movedPc = board[from];
-  const Piece capturedPc = board[to];
+  switch (move_type(move)) {
+  case MT_NORMAL:
+  case MT_PROMOTION: {
+    const Piece movedPc = board[from];
+    const Piece capturedPc = board[to];
+    const Piece arrivedPc = move_type(move) == MT_PROMOTION ? makePiece(us, promo_type(move)) : movedPc;
+
+    if (capturedPc != NO_PIECE) {
+      newKey ^= ZOBRIST_PSQ[capturedPc][to];
 
-  if (capturedPc != NO_PIECE)
-    newKey ^= ZOBRIST_PSQ[capturedPc][to];
+      if (piece_type(capturedPc) == ROOK)
+        newCastlingRights &= ROOK_SQR_TO_CR[to];
+    }
 
-  newKey ^= ZOBRIST_PSQ[movedPc][from] ^ ZOBRIST_PSQ[movedPc][to];
+    newKey ^= ZOBRIST_PSQ[movedPc][from] ^ ZOBRIST_PSQ[arrivedPc][to];
 
-  newKey ^= ZOBRIST_TEMPO;
+    switch (piece_type(movedPc)) {
+    case PAWN: {
+      const int push = (us == WHITE ? 8 : -8);
+      if (to == from + 2*push && (getPawnAttacks(from + push, us) & pieces(them, PAWN)))
+        newKey ^= ZOBRIST_EP[fileOf(from + push)];
+      break;
+    }
+    case ROOK:
+      newCastlingRights &= ROOK_SQR_TO_CR[from];
+      break;
+    case KING:
+      newCastlingRights &= (us == WHITE ? BLACK_CASTLING : WHITE_CASTLING);
+      break;
+    }
+    break;
+  }
+  case MT_CASTLING: {
+    const CastlingData* cd = &CASTLING_DATA[castling_type(move)];
+    const Piece ourKingPc = makePiece(us, KING);
+    const Piece ourRookPc = makePiece(us, ROOK);
+
+    newKey ^= ZOBRIST_PSQ[ourKingPc][cd->kingSrc] ^ ZOBRIST_PSQ[ourKingPc][cd->kingDest]
+            ^ ZOBRIST_PSQ[ourRookPc][cd->rookSrc] ^ ZOBRIST_PSQ[ourRookPc][cd->rookDest];
+
+    newCastlingRights &= (us == WHITE ? BLACK_CASTLING : WHITE_CASTLING);
+    break;
+  }
+  case MT_EN_PASSANT: {
+    const Piece ourPawnPc = makePiece(us, PAWN);
+    const Square capSq = (us == WHITE ? to-8 : to+8);
+
+    newKey ^= ZOBRIST_PSQ[ourPawnPc][from] ^ ZOBRIST_PSQ[ourPawnPc][to]
+            ^ ZOBRIST_PSQ[makePiece(them, PAWN)][capSq];
+    break;
+  }
+  }
+
+  if (newCastlingRights != castlingRights)
+    newKey ^= ZOBRIST_CASTLING[castlingRights ^ newCastlingRights];
+
+  return newKey;
+}
+
+Key Position::keyAfterNullMove() const {
+  Key newKey = key ^ ZOBRIST_TEMPO;
+
+  if (epSquare != SQ_NONE)
+    newKey ^= ZOBRIST_EP[fileOf(epSquare)];
 
   return newKey;
 }
@@ -163,9 +163,11 @@ struct alignas(32) Position {
 
   void calcThreats(Threats& threats);
 
-  /// Only works for MT_NORMAL moves
+  /// The key doMove would produce, without doing the move
   Key keyAfter(Move move) const;
 
+  Key keyAfterNullMove() const;
+
   bool seeGe(Move m, int threshold) const;
 
   void setToFen(const std::string& fen);
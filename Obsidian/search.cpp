@@ -12,6 +12,7 @@
 #include <climits>
 #include <cmath>
 #include <sstream>
+#include <thread>
 #include <unordered_map>
 
 namespace Search {
@@ -72,6 +73,7 @@ namespace Search {
     movestogo = 0;
     depth = MAX_PLY-4; // no depth limit by default
     nodes = 0;
+    silent = false;
   }
 
   Move moveFromTbProbeRoot(Position& pos, unsigned tbResult) {
@@ -120,6 +122,15 @@ namespace Search {
     initLmrTable();
   }
 
+  AccumulatorStats& AccumulatorStats::operator+=(const AccumulatorStats& other) {
+    pushed += other.pushed;
+    incremental += other.incremental;
+    fused += other.fused;
+    refreshed += other.refreshed;
+    skipped += other.skipped;
+    return *this;
+  }
+
   void Thread::resetHistories() {
     memset(mainHistory, 0, sizeof(mainHistory));
     memset(captureHistory, 0, sizeof(captureHistory));
@@ -130,9 +141,14 @@ namespace Search {
     searchPrevScore = SCORE_NONE;
   }
 
+  void Thread::invalidateFinny() {
+    finnyValid = false;
+  }
+
   Thread::Thread()
   {
     resetHistories();
+    evalCache.resize(size_t(Options["EvalCache"]));
   }
 
   template<bool root>
@@ -176,18 +192,66 @@ namespace Search {
     return timeMillis() - Threads::getSearchSettings().startTime;
   }
 
+  // How closely the searches stopped at their limits, since the engine started
+  struct LimitStats {
+    uint64_t nodeSearches = 0;
+    uint64_t nodeDeviationSum = 0;
+    int64_t nodeDeviationMin = 0;
+    int64_t nodeDeviationMax = 0;
+
+    uint64_t timeSearches = 0;
+    int64_t overshootSum = 0;
+    int64_t overshootMax = 0;
+  };
+
+  LimitStats limitStats;
+
+  // nodeLimit is 0, and timeOvershoot negative, when the search didn't stop because of them
+  void recordLimits(uint64_t nodeLimit, uint64_t nodes, int64_t timeOvershoot) {
+    if (nodeLimit) {
+      const int64_t deviation = int64_t(nodes - nodeLimit);
+      limitStats.nodeSearches++;
+      limitStats.nodeDeviationSum += std::abs(deviation);
+      limitStats.nodeDeviationMin = std::min(limitStats.nodeDeviationMin, deviation);
+      limitStats.nodeDeviationMax = std::max(limitStats.nodeDeviationMax, deviation);
+    }
+
+    if (timeOvershoot >= 0) {
+      limitStats.timeSearches++;
+      limitStats.overshootSum += timeOvershoot;
+      limitStats.overshootMax = std::max(limitStats.overshootMax, timeOvershoot);
+    }
+  }
+
+  void printLimitStats() {
+    const LimitStats& ls = limitStats;
+
+    std::cout << "Node limited searches: " << ls.nodeSearches;
+    if (ls.nodeSearches)
+      std::cout << ", mean deviation " << ls.nodeDeviationSum / ls.nodeSearches
+                << " nodes, range " << ls.nodeDeviationMin << " to " << ls.nodeDeviationMax;
+
+    std::cout << "\nSearches stopped by time: " << ls.timeSearches;
+    if (ls.timeSearches)
+      std::cout << ", mean overshoot " << ls.overshootSum / ls.timeSearches
+                << " ms, max " << ls.overshootMax << " ms";
+
+    std::cout << std::endl;
+  }
+
   void printInfo(int depth, int pvIdx, Score score, const std::string& pvString) {
     const int64_t elapsed = elapsedTime();
+    const Threads::CountersSnapshot counters = Threads::countersSnapshot();
     std::ostringstream infoStr;
         infoStr
           << "info"
           << " depth "    << depth
           << " multipv "  << pvIdx
           << " score "    << UCI::scoreToString(score)
-          << " nodes "    << Threads::totalNodes()
-          << " nps "      << (Threads::totalNodes() * 1000ULL) / std::max<int64_t>(elapsed, 1LL)
+          << " nodes "    << counters.nodes
+          << " nps "      << (counters.nodes * 1000ULL) / std::max<int64_t>(elapsed, 1LL)
           << " hashfull " << TT::hashfull()
-          << " tbhits "   << Threads::totalTbHits()
+          << " tbhits "   << counters.tbHits
           << " time "     << elapsed
           << " pv "       << pvString;
 
@@ -237,32 +301,32 @@ namespace Search {
     keyStackHead--;
   }
 
+  // Updates every entry of the table to the given position, as if the king of each
+  // side stood in each bucket
+  void Thread::warmFinny(Position& pos) {
+    for (Color side = WHITE; side <= BLACK; ++side) {
+      bool warmed[2][NNUE::KingBuckets] = {};
+
+      for (Square king = SQ_A1; king <= SQ_H8; ++king) {
+        const bool mirrored = fileOf(king) >= FILE_E;
+        const int bucket = NNUE::KingBucketsScheme[relative_square(side, king)];
+        if (warmed[mirrored][bucket])
+          continue;
+
+        finny[mirrored][bucket].update(pos, king, side);
+        warmed[mirrored][bucket] = true;
+      }
+    }
+  }
+
   void Thread::refreshAccumulator(Position& pos, NNUE::Accumulator& acc, Color side) {
     const Square king = pos.kingSquare(side);
     const int bucket = NNUE::KingBucketsScheme[relative_square(side, king)];
     NNUE::FinnyEntry& entry = finny[fileOf(king) >= FILE_E][bucket];
 
-    for (Color c = WHITE; c <= BLACK; ++c) {
-      for (PieceType pt = PAWN; pt <= KING; ++pt) {
-        const Bitboard oldBB = entry.byColorBB[side][c] & entry.byPieceBB[side][pt];
-        const Bitboard newBB = pos.pieces(c, pt);
-        Bitboard toRemove = oldBB & ~newBB;
-        Bitboard toAdd = newBB & ~oldBB;
-
-        while (toRemove) {
-          Square sq = popLsb(toRemove);
-          entry.acc.removePiece(king, side, makePiece(c, pt), sq);
-        }
-        while (toAdd) {
-          Square sq = popLsb(toAdd);
-          entry.acc.addPiece(king, side, makePiece(c, pt), sq);
-        }
-      }
-    }
+    entry.update(pos, king, side);
     acc.updated[side] = true;
     memcpy(acc.colors[side], entry.acc.colors[side], sizeof(acc.colors[0]));
-    memcpy(entry.byColorBB[side], pos.byColorBB, sizeof(entry.byColorBB[0]));
-    memcpy(entry.byPieceBB[side], pos.byPieceBB, sizeof(entry.byPieceBB[0]));
   }
 
   void Thread::updateAccumulator(Position& pos, NNUE::Accumulator& head) {
@@ -278,15 +342,25 @@ namespace Search {
 
         if (NNUE::needRefresh(side, iter->kings[side], king)) {
           refreshAccumulator(pos, head, side);
+          accStats.refreshed++;
           break;
         }
 
         if (iter->updated[side]) {
-          NNUE::Accumulator* lastUpdated = iter;
-          while (lastUpdated != &head) {
-            (lastUpdated+1)->doUpdates(king, side, *lastUpdated);
-            lastUpdated++;
+          if (iter + 1 == &head) {
+            head.doUpdates(king, side, *iter);
+            accStats.incremental++;
+            break;
           }
+
+          // Several plies behind. Apply the net changes of all of them in one pass,
+          // the accumulators in between get updated only if someone evaluates them
+          NNUE::FeatureUpdates updates;
+          for (NNUE::Accumulator* acc = iter + 1; acc <= &head; acc++)
+            updates.addDirtyPieces(acc->dirtyPieces);
+
+          head.applyUpdates(king, side, *iter, updates);
+          accStats.fused++;
           break;
         }
       }
@@ -294,14 +368,19 @@ namespace Search {
   }
 
   Score Thread::doEvaluation(Position& pos) {
-    NNUE::Accumulator& acc = accumStack[accumStackHead];
-    updateAccumulator(pos, acc);
-    return Eval::evaluate(pos, acc);
+    Score nnueScore;
+    if (!evalCache.probe(pos.key, nnueScore)) {
+      NNUE::Accumulator& acc = accumStack[accumStackHead];
+      updateAccumulator(pos, acc);
+      nnueScore = NNUE::evaluate(pos, acc);
+      evalCache.store(pos.key, nnueScore);
+    }
+    return Eval::evaluate(pos, nnueScore);
   }
 
   void Thread::playMove(Position& pos, Move move, SearchInfo* ss) {
 
-    nodesSearched++;
+    counters.addNode();
 
     const bool isCap = pos.board[move_to(move)] != NO_PIECE;
     ss->contHistory = contHistory[isCap][pieceTo(pos, move)];
@@ -317,9 +396,13 @@ namespace Search {
       newAcc.updated[side] = false;
       newAcc.kings[side] = pos.kingSquare(side);
     }
+    accStats.pushed += 2;
   }
 
   void Thread::cancelMove() {
+    const NNUE::Accumulator& acc = accumStack[accumStackHead];
+    accStats.skipped += !acc.updated[WHITE] + !acc.updated[BLACK];
+
     ply--;
     keyStackHead--;
     accumStackHead--;
@@ -461,9 +544,44 @@ namespace Search {
     return (eval * (200 - pos.halfMoveClock)) / 200;
   }
 
+  // Called on entering every node. The clock is checked once every checkInterval nodes, by
+  // the main thread only, and the node budget on every node. Returns true if the search
+  // has to stop
+  inline bool Thread::checkLimits() {
+    if (++maxTimeCounter >= checkInterval) {
+      maxTimeCounter = 0;
+      if (this == Threads::mainThread() && elapsedTime() >= maxTime) {
+        stoppedByTime = true;
+        Threads::stopSearch();
+      }
+    }
+
+    // Nodes are counted when a move is played, and every move played is followed by a
+    // node, so a thread never counts more than it claimed. The exception is the main thread
+    // during depth 1, which is always completed
+    if (counters.getNodes() >= nodeAllowance) {
+      const uint64_t claimed = Threads::claimNodes(checkInterval);
+      if (claimed)
+        nodeAllowance += claimed;
+      else if (this != Threads::mainThread()) {
+        // The limit only applies once the main thread has a move to play
+        while (!Threads::mainThread()->completeDepth && !Threads::isSearchStopped())
+          std::this_thread::yield();
+        Threads::stopSearch();
+      }
+      else if (completeDepth)
+        Threads::stopSearch();
+    }
+
+    return Threads::isSearchStopped();
+  }
+
   template<bool IsPV>
   Score Thread::qsearch(Position& pos, Score alpha, Score beta, int depth, SearchInfo* ss) {
 
+    if (checkLimits())
+      return SCORE_DRAW;
+
     // Detect upcoming draw
     if (alpha < SCORE_DRAW && hasUpcomingRepetition(pos, ply)) {
       alpha = SCORE_DRAW;
@@ -481,7 +599,8 @@ namespace Search {
 
     // Probe TT
     bool ttHit;
-    TT::Entry* ttEntry = TT::probe(pos.key, ttHit);
+    TT::Entry ttData;
+    TT::Entry* ttEntry = TT::probeQsearch(pos.key, ttHit, ttData);
     TT::Flag ttBound = TT::NO_FLAG;
     Score ttScore = SCORE_NONE;
     Move ttMove = MOVE_NONE;
@@ -489,11 +608,11 @@ namespace Search {
     bool ttPV = false;
 
     if (ttHit) {
-      ttBound = ttEntry->getBound();
-      ttScore = ttEntry->getScore(ply);
-      ttMove = ttEntry->getMove();
-      ttStaticEval = ttEntry->getStaticEval();
-      ttPV = ttEntry->wasPV();
+      ttBound = ttData.getBound();
+      ttScore = ttData.getScore(ply);
+      ttMove = ttData.getMove();
+      ttStaticEval = ttData.getStaticEval();
+      ttPV = ttData.wasPV();
     }
 
     // In non PV nodes, if tt bound allows it, return ttScore
@@ -553,7 +672,7 @@ namespace Search {
 
     while (move = movePicker.nextMove(false)) {
 
-      TT::prefetch(pos.keyAfter(move));
+      TT::prefetchQsearch(pos.keyAfter(move));
 
       if (!pos.isLegal(move))
         continue;
@@ -579,6 +698,9 @@ namespace Search {
 
       cancelMove();
 
+      if (Threads::isSearchStopped())
+        return SCORE_DRAW;
+
       if (score > bestScore) {
         bestScore = score;
 
@@ -643,14 +765,7 @@ namespace Search {
 
     const bool IsRoot = IsPV && ply == 0;
 
-    // Check time
-    ++maxTimeCounter;
-    if ( this == Threads::mainThread()
-      && (maxTimeCounter & 4095) == 0
-      && elapsedTime() >= maxTime)
-        Threads::stopSearch();
-
-    if (Threads::isSearchStopped())
+    if (checkLimits())
       return SCORE_DRAW;
 
     // Init node
@@ -684,7 +799,8 @@ namespace Search {
 
     // Probe TT
     bool ttHit;
-    TT::Entry* ttEntry = TT::probe(pos.key, ttHit);
+    TT::Entry ttData;
+    TT::Entry* ttEntry = TT::probe(pos.key, ttHit, ttData);
 
     TT::Flag ttBound = TT::NO_FLAG;
     Score ttScore   = SCORE_NONE;
@@ -694,12 +810,12 @@ namespace Search {
     bool ttPV = IsPV;
 
     if (ttHit) {
-      ttBound = ttEntry->getBound();
-      ttScore = ttEntry->getScore(ply);
-      ttMove = ttEntry->getMove();
-      ttDepth = ttEntry->getDepth();
-      ttStaticEval = ttEntry->getStaticEval();
-      ttPV |= ttEntry->wasPV();
+      ttBound = ttData.getBound();
+      ttScore = ttData.getScore(ply);
+      ttMove = ttData.getMove();
+      ttDepth = ttData.getDepth();
+      ttStaticEval = ttData.getStaticEval();
+      ttPV |= ttData.wasPV();
     }
 
     if (IsRoot)
@@ -729,7 +845,7 @@ namespace Search {
 
     if (tbResult != TB_RESULT_FAILED) {
 
-      tbHits++;
+      counters.addTbHit();
       Score tbScore;
       TT::Flag tbBound;
 
@@ -775,14 +891,13 @@ namespace Search {
     }
     else if (excludedMove) {
       // We have already evaluated the position in the node which invoked this singular search
-      updateAccumulator(pos, accumStack[accumStackHead]);
       rawStaticEval = eval = ss->staticEval;
     }
     else {
       if (ttStaticEval != SCORE_NONE) {
+        // The accumulator is left dirty, if a child ever gets evaluated it will
+        // catch up from the nearest computed ancestor
         rawStaticEval = ttStaticEval;
-        if (IsPV)
-          updateAccumulator(pos, accumStack[accumStackHead]);
       }
       else
         rawStaticEval = doEvaluation(pos);
@@ -814,6 +929,10 @@ namespace Search {
       && alpha < 2000
       && eval < alpha - RazoringDepthMul * depth) {
       Score score = qsearch<IsPV>(pos, alpha, beta, 0, ss);
+
+      if (Threads::isSearchStopped())
+        return SCORE_DRAW;
+
       if (score <= alpha)
         return score;
     }
@@ -835,7 +954,7 @@ namespace Search {
       && pos.hasNonPawns(pos.sideToMove)
       && beta > SCORE_TB_LOSS_IN_MAX_PLY) {
 
-      TT::prefetch(pos.key ^ ZOBRIST_TEMPO);
+      TT::prefetch(pos.keyAfterNullMove());
 
       int R = std::min((eval - beta) / NmpEvalDiv, (int)NmpEvalDivMin) + depth / NmpDepthDiv + NmpBase + ttMoveNoisy;
 
@@ -844,6 +963,9 @@ namespace Search {
       Score score = -negamax<false>(newPos, -beta, -beta + 1, depth - R, !cutNode, ss + 1);
       cancelNullMove();
 
+      if (Threads::isSearchStopped())
+        return SCORE_DRAW;
+
       if (score >= beta)
         return score < SCORE_TB_WIN_IN_MAX_PLY ? score : beta;
     }
@@ -887,6 +1009,9 @@ namespace Search {
 
         cancelMove();
 
+        if (Threads::isSearchStopped())
+          return SCORE_DRAW;
+
         if (score >= probcutBeta) {
           ttEntry->store(pos.key, TT::FLAG_LOWER, depth - 3, move, score, rawStaticEval, ttPV, ply);
           return score;
@@ -944,7 +1069,7 @@ namespace Search {
 
       int history = isQuiet ? getQuietHistory(pos, move, ss) : getCapHistory(pos, move);
 
-      int oldNodesSearched = nodesSearched;
+      uint64_t oldNodesSearched = counters.getNodes();
 
       if ( !IsRoot
         && bestScore > SCORE_TB_LOSS_IN_MAX_PLY
@@ -991,6 +1116,9 @@ namespace Search {
 
         Score seScore = negamax<false>(pos, singularBeta - 1, singularBeta, (depth - 1) / 2, cutNode, ss, move);
 
+        if (Threads::isSearchStopped())
+          return SCORE_DRAW;
+
         if (seScore < singularBeta) {
           // Extend even more if s. value is smaller than s. beta by some margin
           if (   !IsPV
@@ -1071,7 +1199,7 @@ namespace Search {
 
       if (IsRoot) {
         RootMove& rm = rootMoves[rootMoves.indexOf(move)];
-        rm.nodes += nodesSearched - oldNodesSearched;
+        rm.nodes += counters.getNodes() - oldNodesSearched;
 
         if (seenMoves == 1 || score > alpha) {
           rm.score = score;
@@ -1214,9 +1342,15 @@ namespace Search {
       accumStack[0].kings[side] = rootPos.kingSquare(side);
     }
 
-    for (int i = 0; i < 2; i++)
+    if (!finnyValid) {
+      for (int i = 0; i < 2; i++)
         for (int j = 0; j < NNUE::KingBuckets; j++)
           finny[i][j].reset();
+      finnyValid = true;
+    }
+
+    if (Options["WarmFinnyTable"])
+      warmFinny(rootPos);
 
     keyStackHead = 0;
     for (int i = 0; i < settings.prevPositions.size(); i++)
@@ -1234,6 +1368,11 @@ namespace Search {
 
     ply = 0;
     maxTimeCounter = 0;
+    checkInterval = int(Options["CheckInterval"]);
+    stoppedByTime = false;
+
+    // With a node limit, every node has to be claimed from the shared budget first
+    nodeAllowance = settings.nodes ? 0 : UINT64_MAX;
 
     // Setup search stack
 
@@ -1344,11 +1483,6 @@ namespace Search {
           else
             break;
 
-          if (settings.nodes && Threads::totalNodes() >= settings.nodes) {
-            naturalExit = false;
-            goto bestMoveDecided;
-          }
-
           window += window / 3;
         }
 
@@ -1357,22 +1491,19 @@ namespace Search {
 
       completeDepth = rootDepth;
 
-      if (settings.nodes && Threads::totalNodes() >= settings.nodes) {
-        naturalExit = false;
-        goto bestMoveDecided;
-      }
-
       if (this != Threads::mainThread())
         continue;
 
       const int64_t elapsed = elapsedTime();
 
-      if (std::string(Options["Minimal"]) != "true")
+      if (!settings.silent && std::string(Options["Minimal"]) != "true")
         for (int i = 0; i < multiPV; i++)
           printInfo(completeDepth, i+1, rootMoves[i].score, getPvString(rootMoves[i]));
 
-      if (elapsedTime() >= maxTime)
+      if (elapsedTime() >= maxTime) {
+        stoppedByTime = true;
         goto bestMoveDecided;
+      }
 
       const Move bestMove = rootMoves[0].move;
       const Score score = rootMoves[0].score;
@@ -1383,8 +1514,8 @@ namespace Search {
         searchStability = 0;
 
       if (settings.standardTimeLimit() && rootDepth >= 4) {
-        int bmNodes = rootMoves[rootMoves.indexOf(bestMove)].nodes;
-        double notBestNodes = 1.0 - (bmNodes / double(nodesSearched));
+        uint64_t bmNodes = rootMoves[rootMoves.indexOf(bestMove)].nodes;
+        double notBestNodes = 1.0 - (bmNodes / double(counters.getNodes()));
         double nodesFactor     = (tm1/100.0) + notBestNodes * (tm0/100.0);
 
         double stabilityFactor = (tm2/100.0) - searchStability * (tm3/100.0);
@@ -1454,12 +1585,27 @@ namespace Search {
       }
     }
 
-    if (!naturalExit || bestThread != this || std::string(Options["Minimal"]) == "true")
+    if (  !settings.silent
+        && (!naturalExit || bestThread != this || std::string(Options["Minimal"]) == "true"))
         for (int i = 0; i < multiPV; i++)
           printInfo(bestThread->completeDepth, i+1, bestThread->rootMoves[i].score, getPvString(bestThread->rootMoves[i]));
 
     searchPrevScore = bestThread->rootMoves[0].score;
 
+    // Only searches that ran into their limits tell how precise the limits are
+    recordLimits(naturalExit ? 0 : settings.nodes, Threads::totalNodes(),
+                 stoppedByTime ? elapsedTime() - maxTime : -1);
+
+    if constexpr (TT::CollectStats) {
+      TT::Stats ttStats;
+      for (Search::Thread* st : Threads::searchThreads)
+        ttStats += st->ttStats;
+      TT::recordSearch(ttStats);
+    }
+
+    if (settings.silent)
+      return;
+
     if (tbBestMove && std::abs(searchPrevScore) < SCORE_MATE_IN_MAX_PLY)
       printBestMove(tbBestMove);
     else
@@ -1467,18 +1613,14 @@ namespace Search {
   }
 
   void Thread::idleLoop() {
-    while (true) {
-      std::unique_lock lock(mutex);
-      cv.wait(lock, [&] { return searching; });
+    TT::setThreadStats(&ttStats);
 
-      if (exitThread)
-          return;
+    uint64_t generation = Threads::threadReady();
 
-   // searching = true; (already done by the UCI thread)
+    while (Threads::waitForStart(this, generation)) {
+      startLatency = Threads::nanosSinceStart();
       startSearch();
-      searching = false;
-
-      cv.notify_all();
+      Threads::searchFinished(this);
     }
   }
 }
@@ -1,11 +1,13 @@
 #pragma once
 
+#include "evalcache.h"
 #include "history.h"
 #include "nnue.h"
 #include "position.h"
+#include "tt.h"
 #include "types.h"
 
-#include <condition_variable>
+#include <atomic>
 #include <vector>
 
 namespace Search {
@@ -16,6 +18,9 @@ namespace Search {
     int movestogo, depth;
     uint64_t nodes;
 
+    // No info or bestmove output, for searches the engine runs for itself
+    bool silent;
+
     Position position;
 
     std::vector<uint64_t> prevPositions;
@@ -46,30 +51,96 @@ namespace Search {
   // it's easier to determine conthist score, improving, ...
   constexpr int SsOffset = 6;
 
+  // How much accumulator work a thread has done, and how much it got away without.
+  // Each pushed accumulator has two perspectives, every one of them is either computed
+  // (incrementally, as the head of a multi-ply catch-up, or by a refresh) or skipped
+  struct AccumulatorStats {
+    uint64_t pushed = 0;
+    uint64_t incremental = 0;
+    uint64_t fused = 0;
+    uint64_t refreshed = 0;
+    uint64_t skipped = 0;
+
+    AccumulatorStats& operator+=(const AccumulatorStats& other);
+  };
+
+  // Written by its own thread only, and read by the others to report and check limits.
+  // Kept on a cache line of its own, so that these reads never steal the line holding the
+  // rest of the thread's state
+  struct alignas(64) NodeCounters {
+
+    inline void addNode() {
+      bump(nodes);
+    }
+
+    inline void addTbHit() {
+      bump(tbHits);
+    }
+
+    inline uint64_t getNodes() const {
+      return nodes.load(std::memory_order_relaxed);
+    }
+
+    inline uint64_t getTbHits() const {
+      return tbHits.load(std::memory_order_relaxed);
+    }
+
+    void reset() {
+      nodes.store(0, std::memory_order_relaxed);
+      tbHits.store(0, std::memory_order_relaxed);
+    }
+
+  private:
+    std::atomic<uint64_t> nodes = 0;
+    std::atomic<uint64_t> tbHits = 0;
+
+    // A single writer doesn't need a locked increment
+    static inline void bump(std::atomic<uint64_t>& counter) {
+      counter.store(counter.load(std::memory_order_relaxed) + 1, std::memory_order_relaxed);
+    }
+  };
+
   class Thread {
 
   public:
 
-    std::mutex mutex;
-    std::condition_variable cv;
-
-    volatile bool searching = false;
-    volatile bool exitThread = false;
+    // Set by the pool, under its lock, when the thread is removed
+    bool exitThread = false;
 
     volatile int completeDepth;
-    volatile uint64_t nodesSearched;
-    volatile uint64_t tbHits;
+
+    // Nanoseconds between the start of the last search and the moment this thread joined it
+    int64_t startLatency = 0;
+
+    NodeCounters counters;
+
+    AccumulatorStats accStats;
+
+    // Counted in TT_STATS builds only, for the current search
+    TT::Stats ttStats;
+
+    Eval::EvalCache evalCache;
 
     Thread();
 
     void resetHistories();
 
+    // The refresh table outlives searches, it only needs to be dropped when the
+    // position it was built from becomes unrelated (new game) or the net changes
+    void invalidateFinny();
+
     void idleLoop();
 
   private:
 
     int64_t optimumTime, maxTime;
-    uint32_t maxTimeCounter;
+    uint32_t maxTimeCounter, checkInterval;
+    bool stoppedByTime;
+
+    // Node count at which the next chunk of the node budget has to be claimed
+    uint64_t nodeAllowance;
+
+    bool checkLimits();
 
     int rootDepth;
 
@@ -93,9 +164,12 @@ namespace Search {
     PawnCorrectionHistory pawnCorrhist;
 
     NNUE::FinnyTable finny;
+    bool finnyValid = false;
 
     Score searchPrevScore;
 
+    void warmFinny(Position& pos);
+
     void refreshAccumulator(Position& pos, NNUE::Accumulator& acc, Color side);
 
     void updateAccumulator(Position& pos, NNUE::Accumulator& acc);
@@ -146,4 +220,7 @@ namespace Search {
   void init();
 
   void printInfo(int depth, int pvIdx, Score score, const std::string& pvString);
+
+  /// Node deviation of node limited searches, and overshoot of the searches stopped by time
+  void printLimitStats();
 }
@@ -1,15 +1,42 @@
 #pragma once
 
-#include <algorithm>
 #include <cstdint>
 #include <immintrin.h>
 
+// The kernels of fat binaries are compiled with a raised target, which doesn't update the
+// predefined macros in C++, so they select their instruction set explicitly
+#if !defined(SIMD_AVX512) && !defined(SIMD_AVX2) && !defined(SIMD_SSE2)
+#  if defined(__AVX512F__) && defined(__AVX512BW__)
+#    define SIMD_AVX512
+#    if defined(__AVX512VNNI__)
+#      define SIMD_VNNI
+#    endif
+#  elif defined(__AVX2__)
+#    define SIMD_AVX2
+#    if defined(__AVXVNNI__)
+#      define SIMD_VNNI
+#    endif
+#  else
+#    define SIMD_SSE2
+#  endif
+#endif
+
 namespace SIMD {
 
-#if defined(__AVX512F__) && defined(__AVX512BW__)
+// Fat binaries include this header in several translation units, each with a different
+// target. Internal linkage keeps the different definitions of these helpers apart
+namespace {
+
+#if defined(SIMD_AVX512)
 
   using Vec = __m512i;
 
+#if defined(SIMD_VNNI)
+  constexpr const char* ArchName = "avx512vnni";
+#else
+  constexpr const char* ArchName = "avx512";
+#endif
+
   inline Vec addEpi16(Vec x, Vec y) {
     return _mm512_add_epi16(x, y);
   }
@@ -38,6 +65,20 @@ namespace SIMD {
     return _mm512_madd_epi16(x, y);
   }
 
+  // sum + maddEpi16(x, y), fused into a single instruction by VNNI
+  inline Vec dpwssdEpi32(Vec sum, Vec x, Vec y) {
+#if defined(SIMD_VNNI)
+    return _mm512_dpwssd_epi32(sum, x, y);
+#else
+    return _mm512_add_epi32(sum, _mm512_madd_epi16(x, y));
+#endif
+  }
+
+  // Sign extends a vector worth of 8 bit values to 16 bits
+  inline Vec loadEpi8AsEpi16(const int8_t* p) {
+    return _mm512_cvtepi8_epi16(_mm256_load_si256((const __m256i*) p));
+  }
+
   inline Vec vecSetZero() {
     return _mm512_setzero_si512();
   }
@@ -50,10 +91,16 @@ namespace SIMD {
     return _mm512_reduce_add_epi32(vec);
   }
 
-#elif defined(__AVX2__)
+#elif defined(SIMD_AVX2)
 
   using Vec = __m256i;
 
+#if defined(SIMD_VNNI)
+  constexpr const char* ArchName = "avxvnni";
+#else
+  constexpr const char* ArchName = "avx2";
+#endif
+
   inline Vec addEpi16(Vec x, Vec y) {
     return _mm256_add_epi16(x, y);
   }
@@ -82,6 +129,18 @@ namespace SIMD {
     return _mm256_madd_epi16(x, y);
   }
 
+  inline Vec dpwssdEpi32(Vec sum, Vec x, Vec y) {
+#if defined(SIMD_VNNI)
+    return _mm256_dpwssd_avx_epi32(sum, x, y);
+#else
+    return _mm256_add_epi32(sum, _mm256_madd_epi16(x, y));
+#endif
+  }
+
+  inline Vec loadEpi8AsEpi16(const int8_t* p) {
+    return _mm256_cvtepi8_epi16(_mm_load_si128((const __m128i*) p));
+  }
+
   inline Vec vecSetZero() {
     return _mm256_setzero_si256();
   }
@@ -121,6 +180,8 @@ namespace SIMD {
 
   using Vec = __m128i;
 
+  constexpr const char* ArchName = "sse2";
+
   inline Vec addEpi16(Vec x, Vec y) {
     return _mm_add_epi16(x, y);
   }
@@ -149,6 +210,16 @@ namespace SIMD {
     return _mm_madd_epi16(x, y);
   }
 
+  inline Vec dpwssdEpi32(Vec sum, Vec x, Vec y) {
+    return _mm_add_epi32(sum, _mm_madd_epi16(x, y));
+  }
+
+  // No pmovsxbw before SSE4.1: duplicate each byte into a word, then shift the copy out
+  inline Vec loadEpi8AsEpi16(const int8_t* p) {
+    const Vec bytes = _mm_loadl_epi64((const Vec*) p);
+    return _mm_srai_epi16(_mm_unpacklo_epi8(bytes, bytes), 8);
+  }
+
   inline Vec vecSetZero() {
     return _mm_setzero_si128();
   }
@@ -169,6 +240,6 @@ namespace SIMD {
 
 #endif
 
-  constexpr int Alignment = std::max<int>(8, sizeof(Vec));
+}
 
 }
\ No newline at end of file
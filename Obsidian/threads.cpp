@@ -1,5 +1,10 @@
 #include "threads.h"
+#include "numa.h"
+#include <algorithm>
 #include <atomic>
+#include <chrono>
+#include <condition_variable>
+#include <mutex>
 
 namespace Threads {
 
@@ -10,6 +15,9 @@ namespace Threads {
 
   std::atomic<bool> searchStopped;
 
+  // Nodes of the node limit not yet handed out to a thread
+  std::atomic<uint64_t> nodeBudget;
+
   Search::Thread* mainThread() {
     return searchThreads[0];
   }
@@ -18,42 +26,110 @@ namespace Threads {
     return searchStopped.load(std::memory_order_relaxed);
   }
 
-  uint64_t totalNodes() {
-    uint64_t result = 0;
-    for (int i = 0; i < searchThreads.size(); i++)
-      result += searchThreads[i]->nodesSearched;
+  uint64_t claimNodes(uint64_t maxChunk) {
+    uint64_t left = nodeBudget.load(std::memory_order_relaxed);
+    while (left) {
+      // Smaller chunks near the end, so that the threads run out at about the same time
+      const uint64_t chunk = std::clamp<uint64_t>(left / (4 * searchThreads.size()), 1, maxChunk);
+      if (nodeBudget.compare_exchange_weak(left, left - chunk, std::memory_order_relaxed))
+        return chunk;
+    }
+    return 0;
+  }
+
+  CountersSnapshot countersSnapshot() {
+    CountersSnapshot result;
+    for (int i = 0; i < searchThreads.size(); i++) {
+      result.nodes += searchThreads[i]->counters.getNodes();
+      result.tbHits += searchThreads[i]->counters.getTbHits();
+    }
     return result;
   }
 
-  uint64_t totalTbHits() {
+  uint64_t totalNodes() {
     uint64_t result = 0;
     for (int i = 0; i < searchThreads.size(); i++)
-      result += searchThreads[i]->tbHits;
+      result += searchThreads[i]->counters.getNodes();
     return result;
   }
 
+  // The pool state, guarded by poolMutex. Idle threads sleep on startCv until the
+  // generation changes, which wakes all of them at once. Whoever waits for a search
+  // (or for the threads to start) sleeps on doneCv
+  std::mutex poolMutex;
+  std::condition_variable startCv, doneCv;
+
+  uint64_t generation = 0;
+  int readyThreads = 0;
+  bool mainSearching = false;
+  int helpersSearching = 0;
+
+  std::chrono::steady_clock::time_point startTime;
+
+  uint64_t threadReady() {
+    std::lock_guard lock(poolMutex);
+    readyThreads++;
+    doneCv.notify_all();
+    return generation;
+  }
+
+  bool waitForStart(Search::Thread* st, uint64_t& seenGeneration) {
+    std::unique_lock lock(poolMutex);
+    startCv.wait(lock, [&] { return generation != seenGeneration || st->exitThread; });
+    seenGeneration = generation;
+    return !st->exitThread;
+  }
+
+  int64_t nanosSinceStart() {
+    return std::chrono::duration_cast<std::chrono::nanoseconds>(
+      std::chrono::steady_clock::now() - startTime).count();
+  }
+
+  void searchFinished(Search::Thread* st) {
+    std::lock_guard lock(poolMutex);
+    if (st == mainThread())
+      mainSearching = false;
+    else
+      helpersSearching--;
+
+    if (!mainSearching || !helpersSearching)
+      doneCv.notify_all();
+  }
+
   void waitForSearch(bool waitMain) {
-    for (int i = !waitMain; i < searchThreads.size(); i++) {
-      Search::Thread* st = searchThreads[i];
-      std::unique_lock lock(st->mutex);
-      st->cv.wait(lock, [&] { return !st->searching; });
-    }
+    std::unique_lock lock(poolMutex);
+    doneCv.wait(lock, [&] { return !helpersSearching && (!waitMain || !mainSearching); });
   }
 
   void startSearch(Search::Settings& settings) {
     searchSettings = settings;
     searchStopped = false;
+    nodeBudget = settings.nodes;
     for (int i = 0; i < searchThreads.size(); i++) {
       Search::Thread* st = searchThreads[i];
-      st->nodesSearched = 0;
-      st->tbHits = 0;
+      st->counters.reset();
       st->completeDepth = 0;
+      st->ttStats = TT::Stats();
+    }
+
+    {
+      std::lock_guard lock(poolMutex);
+      mainSearching = !searchThreads.empty();
+      helpersSearching = std::max<int>(searchThreads.size(), 1) - 1;
+      startTime = std::chrono::steady_clock::now();
+      generation++;
     }
+    startCv.notify_all();
+  }
+
+  StartLatency lastStartLatency() {
+    StartLatency result;
     for (int i = 0; i < searchThreads.size(); i++) {
-      Search::Thread* st = searchThreads[i];
-      st->searching = true;
-      st->cv.notify_all();
+      result.mean += searchThreads[i]->startLatency;
+      result.max = std::max(result.max, searchThreads[i]->startLatency);
     }
+    result.mean /= std::max<int>(searchThreads.size(), 1);
+    return result;
   }
 
   Search::Settings& getSearchSettings() {
@@ -64,40 +140,50 @@ namespace Threads {
     searchStopped = true;
   }
 
-  std::atomic<int> startedThreadsCount;
-
   void threadEntry(int index) {
+    // Pin first, so that the histories get allocated and zeroed on the local node
+    NNUE::useNodeNetwork(Numa::bindThread(index));
+
     searchThreads[index] = new Search::Thread();
-    startedThreadsCount++;
     searchThreads[index]->idleLoop();
   }
 
+  // Threads are only added or removed at the end, the others keep running with their
+  // histories untouched. Indexes stay the same, and so does the core of a bound thread
   void setThreadCount(int threadCount) {
     waitForSearch();
 
-    for (int i = 0; i < searchThreads.size(); i++) {
-      searchThreads[i]->exitThread = true;
-      searchThreads[i]->searching = true; // <-- the predicate
-      searchThreads[i]->cv.notify_all();
-      stdThreads[i]->join();
-      delete searchThreads[i];
-      delete stdThreads[i];
+    const int oldCount = searchThreads.size();
+
+    if (threadCount < oldCount) {
+      {
+        std::lock_guard lock(poolMutex);
+        for (int i = threadCount; i < oldCount; i++)
+          searchThreads[i]->exitThread = true;
+      }
+      startCv.notify_all();
+
+      for (int i = threadCount; i < oldCount; i++) {
+        stdThreads[i]->join();
+        delete searchThreads[i];
+        delete stdThreads[i];
+      }
     }
 
     searchThreads.resize(threadCount);
     stdThreads.resize(threadCount);
 
-    startedThreadsCount = 0;
+    if (threadCount <= oldCount)
+      return;
+
+    std::unique_lock lock(poolMutex);
+    readyThreads = 0;
 
-     for (int i = 0; i < threadCount; i++) {
+    for (int i = oldCount; i < threadCount; i++)
       stdThreads[i] = new std::thread(threadEntry, i);
-    }
 
-    while (startedThreadsCount < threadCount) {
-      // This is necessary because some Search::Thread(s) may not be ready yet.
-      // TODO replace this spin with something cleaner
-      // - this will take like a millisecond, all threads are started immediately
-    }
+    // Every thread has to be waiting for the next generation before a search can start
+    doneCv.wait(lock, [&] { return readyThreads == threadCount - oldCount; });
   }
 
 }
@@ -12,10 +12,21 @@ namespace Threads {
 
   bool isSearchStopped();
 
-  uint64_t totalNodes();
+  /// Hands out up to maxChunk nodes of the node limit of the current search. Returns 0 once
+  /// the whole limit has been handed out
+  uint64_t claimNodes(uint64_t maxChunk);
+
+  struct CountersSnapshot {
+    uint64_t nodes = 0;
+    uint64_t tbHits = 0;
+  };
+
+  // Sums the counters of all threads. Each counter is read once, without locking
+  CountersSnapshot countersSnapshot();
 
-  uint64_t totalTbHits();
+  uint64_t totalNodes();
 
+  /// Waits until the search threads are done (the helpers only, if waitMain is false)
   void waitForSearch(bool waitMain = true);
 
   void startSearch(Search::Settings& settings);
@@ -25,4 +36,26 @@ namespace Threads {
   void stopSearch();
 
   void setThreadCount(int threadCount);
+
+  // Used by the search threads themselves, see Search::Thread::idleLoop
+
+  /// Signals that the calling thread is about to wait for searches. Returns the generation
+  /// to pass to waitForStart
+  uint64_t threadReady();
+
+  /// Sleeps until the next search starts. Returns false if the thread has to exit instead
+  bool waitForStart(Search::Thread* st, uint64_t& seenGeneration);
+
+  int64_t nanosSinceStart();
+
+  void searchFinished(Search::Thread* st);
+
+  struct StartLatency {
+    int64_t mean = 0;
+    int64_t max = 0;
+  };
+
+  /// How long the threads took, in nanoseconds, between startSearch and the beginning
+  /// of their own search, for the last search
+  StartLatency lastStartLatency();
 }
\ No newline at end of file
@@ -1,9 +1,22 @@
 #include "tt.h"
+#include "largepages.h"
+#include "numa.h"
+#include "threads.h"
 
+#include <algorithm>
+#include <cstring>
+#include <fstream>
+#include <iomanip>
 #include <iostream>
+#include <thread>
+#include <vector>
 
-#if defined(__linux__)
+#if !defined(_WIN32)
+#include <fcntl.h>
+#include <sys/file.h>
 #include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
 #endif
 
 namespace TT {
@@ -14,64 +27,541 @@ namespace TT {
   uint8_t tableAge;
   Bucket* buckets = nullptr;
   uint64_t bucketCount;
+  size_t tableMegaBytes;
+  LargePages::Allocation allocation;
+
+  constexpr char SavedMagic[8] = { 'O', 'B', 'S', 'H', 'A', 'S', 'H', '1' };
+
+  // Precedes the buckets in a saved table. Anything that changes the meaning
+  // of the saved bytes must make a file unloadable
+  struct SavedHeader {
+    char magic[8];
+    uint32_t bucketSize;
+    uint32_t entriesPerBucket;
+    uint64_t megaBytes;
+    uint64_t bucketCount;
+    uint8_t tableAge;
+    uint8_t hasFullKeys; // TT_STATS builds save the full key of every entry after the buckets
+    uint8_t padding[6];
+  };
+
+  constexpr char SharedMagic[8] = { 'O', 'B', 'S', 'S', 'H', 'M', 'T', '1' };
+
+  // Start of a shared memory table, followed by the buckets. The processes attached to
+  // it share the age too, so that they agree on which entries are old
+  struct SharedHeader {
+    char magic[8];
+    uint32_t bucketSize;
+    uint32_t entriesPerBucket;
+    uint64_t megaBytes;
+    std::atomic<uint32_t> attached;
+    std::atomic<uint8_t> tableAge;
+  };
+
+  // Keeps the buckets aligned to a page
+  constexpr size_t SharedHeaderSize = 4096;
+
+  thread_local Stats* threadStats = nullptr;
+  Stats lastSearch, allSearches;
+
+  // Full key of every entry, only with CollectStats. It isn't shared between processes
+  std::vector<Key> fullKeys;
+
+  // Optional table for the positions qsearch doesn't find in the main one
+  Bucket* qsBuckets = nullptr;
+  uint64_t qsBucketCount = 0;
+  LargePages::Allocation qsAllocation;
+
+  std::string sharedName;
+  SharedHeader* shared = nullptr;
+  size_t sharedBytes;
+
+  // Below this many bytes per thread, starting the threads costs more than the memset
+  constexpr size_t MinClearSlice = 16 * MEGA;
+
+  // Splits the buckets between threads, calls fn(begin, end) for every slice and returns
+  // how many threads took part. Right after an allocation, this is also the first touch
+  // of the pages, so each slice gets placed on the memory node of its thread
+  template<typename Fn>
+  int inSlices(Fn fn) {
+    const int threadCount = std::clamp<size_t>(
+      sizeof(Bucket) * bucketCount / MinClearSlice, 1, std::max<size_t>(Threads::searchThreads.size(), 1));
+
+    // Helpers pinned like the search threads touch their slice first. Then, when threads
+    // are bound, the table is spread over the nodes instead of landing on a single one
+    auto slice = [&](int index) {
+      if (index)
+        Numa::bindThread(index);
+      fn(bucketCount * index / threadCount, bucketCount * (index + 1) / threadCount);
+    };
+
+    std::vector<std::thread> threads;
+    for (int i = 1; i < threadCount; i++)
+      threads.emplace_back(slice, i);
+
+    slice(0);
+
+    for (std::thread& t : threads)
+      t.join();
+
+    return threadCount;
+  }
+
+  int clearSlices() {
+    return inSlices([](uint64_t begin, uint64_t end) {
+      memset((void*) &buckets[begin], 0, sizeof(Bucket) * (end - begin));
+    });
+  }
+
+  // Fills the (new) table with the entries of the old one. Only the top bits of a key pick
+  // its bucket, and entries don't keep them, so each entry goes to every new bucket its key
+  // could map to: the one it belongs to is among them, the other copies are never found.
+  // Entries offered to more than one bucket lose their depth, so that any store replaces
+  // the copies (the right one still gives its move, bound and eval). Each new bucket keeps
+  // the best entries, by quality, among those offered
+  int rehash(const Bucket* oldBuckets, uint64_t oldCount, const std::vector<Key>& oldFullKeys, uint64_t& kept) {
+    using uint128 = unsigned __int128;
+    std::atomic<uint64_t> keptCount = 0;
+
+    int threadCount = inSlices([&](uint64_t begin, uint64_t end) {
+      uint64_t localKept = 0;
+
+      for (uint64_t j = begin; j < end; j++) {
+        // Old buckets whose share of the key space overlaps the one of bucket j
+        const uint64_t first = uint128(j) * oldCount / bucketCount;
+        const uint64_t last = std::min<uint64_t>(oldCount - 1,
+          (uint128(j + 1) * oldCount + bucketCount - 1) / bucketCount - 1);
+
+        Entry best[EntriesPerBucket] = {};
+        Key bestKeys[EntriesPerBucket] = {};
+        int count = 0;
+
+        for (uint64_t i = first; i <= last; i++) {
+          // Whether the share of old bucket i spans more new buckets than j
+          const bool copied =  uint128(i) * bucketCount / oldCount != j
+                            || (uint128(i + 1) * bucketCount - 1) / oldCount != j;
+
+          for (int k = 0; k < EntriesPerBucket; k++) {
+            Entry entry = oldBuckets[i].entries[k];
+            if (entry.isEmpty())
+              continue;
+
+            if (copied)
+              entry.makeReplaceable();
+
+            // Insertion sort, best first
+            int pos = std::min(count, EntriesPerBucket - 1);
+            if (count == EntriesPerBucket && best[pos].getQuality() >= entry.getQuality())
+              continue;
+
+            while (pos > 0 && best[pos - 1].getQuality() < entry.getQuality()) {
+              best[pos] = best[pos - 1];
+              bestKeys[pos] = bestKeys[pos - 1];
+              pos--;
+            }
+            best[pos] = entry;
+            if constexpr (CollectStats)
+              bestKeys[pos] = oldFullKeys[i * EntriesPerBucket + k];
+
+            count = std::min(count + 1, EntriesPerBucket);
+          }
+        }
+
+        Bucket& bucket = buckets[j];
+        memset((void*) &bucket, 0, sizeof(Bucket));
+        memcpy(bucket.entries, best, sizeof(best));
+
+        if constexpr (CollectStats)
+          memcpy(&fullKeys[j * EntriesPerBucket], bestKeys, sizeof(bestKeys));
+
+        localKept += count;
+      }
+
+      keptCount += localKept;
+    });
+
+    kept = keptCount;
+    return threadCount;
+  }
 
   void clear() {
-    memset(buckets, 0, sizeof(Bucket) * bucketCount);
+    clearSlices();
     tableAge = 0;
+
+    if (qsBuckets)
+      memset((void*) qsBuckets, 0, sizeof(Bucket) * qsBucketCount);
+
+    if constexpr (CollectStats)
+      std::fill(fullKeys.begin(), fullKeys.end(), 0);
+
+    if (shared)
+      shared->tableAge = 0;
   }
 
   void nextSearch() {
-    tableAge = (tableAge+1) % MAX_AGE;
+    if (shared) {
+      // Other processes may have started searches meanwhile
+      uint8_t age = shared->tableAge.load();
+      while (!shared->tableAge.compare_exchange_weak(age, (age + 1) % MAX_AGE)) {}
+      tableAge = (age + 1) % MAX_AGE;
+    }
+    else
+      tableAge = (tableAge+1) % MAX_AGE;
+  }
+
+#if !defined(_WIN32)
+
+  // Attaching and detaching hold an exclusive lock on a companion object, so that the last
+  // process can't unlink the segment while another one attaches to it, and a new segment is
+  // complete once others can open it. The lock object is empty and stays, and a process
+  // that dies holding the lock releases it
+  struct SharedLock {
+    int fd;
+
+    SharedLock() {
+      fd = shm_open((sharedName + ".lock").c_str(), O_RDWR | O_CREAT, 0600);
+      if (fd != -1 && flock(fd, LOCK_EX) == -1) {
+        close(fd);
+        fd = -1;
+      }
+    }
+
+    ~SharedLock() {
+      if (fd != -1)
+        close(fd);
+    }
+  };
+
+  void detachShared() {
+    if (!shared)
+      return;
+
+    SharedLock lock;
+
+    // Attaching happens under the same lock, so the count can't go up before the unlink
+    const bool last = shared->attached.fetch_sub(1) == 1;
+    munmap(shared, sharedBytes);
+    shared = nullptr;
+
+    // The table was inside the segment
+    buckets = nullptr;
+    bucketCount = 0;
+
+    // A crashed process never detaches, in that case the segment stays in /dev/shm
+    if (last)
+      shm_unlink(sharedName.c_str());
+  }
+
+  // Creates the named table, or attaches to it if another process already did. In the
+  // second case the size of the existing table wins over the requested one
+  bool attachShared(size_t& megaBytes, bool& created) {
+    const size_t requestedBytes = SharedHeaderSize + megaBytes * MEGA;
+
+    SharedLock lock;
+    if (lock.fd == -1)
+      return false;
+
+    int fd = shm_open(sharedName.c_str(), O_RDWR | O_CREAT | O_EXCL, 0600);
+    created = fd != -1;
+
+    if (created) {
+      if (ftruncate(fd, requestedBytes) == -1) {
+        close(fd);
+        shm_unlink(sharedName.c_str());
+        return false;
+      }
+    }
+    else {
+      fd = shm_open(sharedName.c_str(), O_RDWR, 0600);
+      if (fd == -1)
+        return false;
+    }
+
+    struct stat st;
+    if (fstat(fd, &st) == -1 || size_t(st.st_size) < SharedHeaderSize) {
+      close(fd);
+      return false;
+    }
+
+    sharedBytes = st.st_size;
+    void* data = mmap(nullptr, sharedBytes, PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0);
+    close(fd);
+
+    if (data == MAP_FAILED) {
+      if (created)
+        shm_unlink(sharedName.c_str());
+      return false;
+    }
+
+    shared = (SharedHeader*) data;
+
+    if (created) {
+      shared->bucketSize = sizeof(Bucket);
+      shared->entriesPerBucket = EntriesPerBucket;
+      shared->megaBytes = megaBytes;
+      shared->attached = 1;
+      shared->tableAge = 0;
+      memcpy(shared->magic, SharedMagic, sizeof(SharedMagic));
+      return true;
+    }
+
+    if ( memcmp(shared->magic, SharedMagic, sizeof(SharedMagic)) != 0
+      || shared->bucketSize != sizeof(Bucket)
+      || shared->entriesPerBucket != EntriesPerBucket
+      || sharedBytes != SharedHeaderSize + shared->megaBytes * MEGA) {
+      munmap(shared, sharedBytes);
+      shared = nullptr;
+      return false;
+    }
+
+    shared->attached++;
+    megaBytes = shared->megaBytes;
+    return true;
+  }
+
+#else
+
+  void detachShared() {}
+
+  bool attachShared(size_t&, bool&) {
+    return false;
+  }
+
+#endif
+
+  void setSharedName(const std::string& name) {
+    detachShared();
+    sharedName = name.empty() || name[0] == '/' ? name : "/" + name;
+  }
+
+  void release() {
+    detachShared();
+    LargePages::release(allocation);
+    buckets = nullptr;
   }
 
   void resize(size_t megaBytes) {
-    if (buckets)
-      free(buckets);
+    // A private table is kept until its entries are moved to the new one
+    LargePages::Allocation oldAllocation;
+    const Bucket* oldBuckets = nullptr;
+    const uint64_t oldCount = bucketCount;
+    std::vector<Key> oldFullKeys;
+
+    // Only a private table owns its allocation, a shared one is gone with the segment
+    if (allocation.ptr) {
+      std::swap(oldAllocation, allocation);
+      oldBuckets = buckets;
+      oldFullKeys.swap(fullKeys);
+    }
+
+    release();
+
+    bool created;
+    if (!sharedName.empty()) {
+      if (attachShared(megaBytes, created)) {
+        tableMegaBytes = megaBytes;
+        bucketCount = megaBytes * MEGA / sizeof(Bucket);
+        buckets = (Bucket*) ((char*) shared + SharedHeaderSize);
+        tableAge = shared->tableAge;
+
+        if constexpr (CollectStats)
+          fullKeys.assign(bucketCount * EntriesPerBucket, 0);
+
+        std::cout << "info string Hash " << megaBytes << " MB in shared memory " << sharedName
+                  << (created ? ", created" : ", attached") << " with "
+                  << shared->attached << " process(es) using it" << std::endl;
+
+        // Zero filled by ftruncate, clearing it anyway places the pages like a private table
+        if (created)
+          clearSlices();
+
+        LargePages::release(oldAllocation);
+        return;
+      }
+
+      std::cout << "info string Could not use shared memory " << sharedName
+                << ", falling back to a private hash" << std::endl;
+    }
 
     size_t bytes = megaBytes * MEGA;
+    tableMegaBytes = megaBytes;
     bucketCount = bytes / sizeof(Bucket);
 
-#if defined(__linux__)
-    buckets = (Bucket*) aligned_alloc(2 * MEGA, bytes);
-    madvise(buckets, bytes, MADV_HUGEPAGE);
-#else
-    buckets = (Bucket*) malloc(sizeof(Bucket) * bucketCount);
-#endif
+    allocation = LargePages::allocate(bytes);
+
+    // No room for both tables: the entries are lost, the new table is cleared instead
+    if (!allocation.ptr && oldBuckets) {
+      LargePages::release(oldAllocation);
+      std::vector<Key>().swap(oldFullKeys);
+      oldBuckets = nullptr;
+      allocation = LargePages::allocate(bytes);
+    }
+
+    buckets = (Bucket*) allocation.ptr;
+
+    if constexpr (CollectStats)
+      fullKeys.assign(bucketCount * EntriesPerBucket, 0);
+
+    int64_t begin = timeMillis();
+
+    std::cout << "info string Hash " << megaBytes << " MB on " << LargePages::describe(allocation);
+
+    int threadCount;
 
-    clear();
+    if (oldBuckets) {
+      // Entries keep their age, so tableAge stays
+      uint64_t kept;
+      threadCount = rehash(oldBuckets, oldCount, oldFullKeys, kept);
+      LargePages::release(oldAllocation);
+
+      std::cout << ", " << kept << " entries moved";
+    }
+    else {
+      threadCount = clearSlices();
+      tableAge = 0;
+
+      std::cout << ", cleared";
+    }
+
+    std::cout << " by " << threadCount << (threadCount > 1 ? " threads" : " thread")
+              << " in " << timeMillis() - begin << " ms" << std::endl;
   }
 
-  Bucket* getBucket(Key key) {
+  void resizeQsearch(size_t megaBytes) {
+    LargePages::release(qsAllocation);
+    qsBuckets = nullptr;
+    qsBucketCount = 0;
+
+    if (!megaBytes)
+      return;
+
+    qsAllocation = LargePages::allocate(megaBytes * MEGA);
+    qsBuckets = (Bucket*) qsAllocation.ptr;
+    qsBucketCount = megaBytes * MEGA / sizeof(Bucket);
+    memset((void*) qsBuckets, 0, sizeof(Bucket) * qsBucketCount);
+
+    std::cout << "info string QSearch hash " << megaBytes << " MB on "
+              << LargePages::describe(qsAllocation) << std::endl;
+  }
+
+  inline Bucket* getBucket(Bucket* table, uint64_t count, Key key) {
     using uint128 = unsigned __int128;
-    uint64_t index = (uint128(key) * uint128(bucketCount)) >> 64;
-    return & buckets[index];
+    uint64_t index = (uint128(key) * uint128(count)) >> 64;
+    return & table[index];
+  }
+
+  Bucket* getBucket(Key key) {
+    return getBucket(buckets, bucketCount, key);
   }
 
   void prefetch(Key key) {
     __builtin_prefetch(getBucket(key));
   }
 
-  Entry* probe(Key key, bool& hit) {
+  void prefetchQsearch(Key key) {
+    __builtin_prefetch(getBucket(key));
+    if (qsBuckets)
+      __builtin_prefetch(getBucket(qsBuckets, qsBucketCount, key));
+  }
+
+  // Copies the entries of a bucket, returns false if a writer was active meanwhile
+  bool readBucket(const Bucket* bucket, Entry* entries) {
+    uint16_t sequence = bucket->sequence.load(std::memory_order_acquire);
+    memcpy(entries, bucket->entries, sizeof(bucket->entries));
+    std::atomic_thread_fence(std::memory_order_acquire);
+    return !(sequence & 1) && bucket->sequence.load(std::memory_order_relaxed) == sequence;
+  }
+
+  // Fails if another thread is writing into the bucket, writers never wait for each other
+  bool lockBucket(Bucket* bucket, uint16_t& sequence) {
+    sequence = bucket->sequence.load(std::memory_order_relaxed);
+    if ((sequence & 1) || !bucket->sequence.compare_exchange_strong(sequence, sequence + 1, std::memory_order_relaxed))
+      return false;
+    std::atomic_thread_fence(std::memory_order_release);
+    return true;
+  }
+
+  void unlockBucket(Bucket* bucket, uint16_t sequence) {
+    bucket->sequence.store(sequence + 2, std::memory_order_release);
+  }
+
+  inline bool inQsearchTable(const Entry* entry) {
+    return qsBuckets && entry >= qsBuckets->entries && entry < qsBuckets[qsBucketCount].entries;
+  }
+
+  Bucket* bucketOf(const Entry* entry) {
+    Bucket* table = inQsearchTable(entry) ? qsBuckets : buckets;
+    return & table[(uintptr_t(entry) - uintptr_t(table)) / sizeof(Bucket)];
+  }
+
+  // Main table only
+  inline Key& fullKeyOf(const Entry* entry) {
+    Bucket* bucket = bucketOf(entry);
+    return fullKeys[(bucket - buckets) * EntriesPerBucket + (entry - bucket->entries)];
+  }
+
+  Entry* probe(Bucket* bucket, Key key, bool& hit, Entry& data) {
+
+    Entry entries[EntriesPerBucket];
 
-    Entry* entries = getBucket(key)->entries;
+    // A torn copy can still pick the entry to replace, but it can't be a hit
+    bool consistent = readBucket(bucket, entries) || readBucket(bucket, entries);
+
+    // Statistics are about the main table
+    Stats* stats = inQsearchTable(bucket->entries) ? nullptr : threadStats;
+
+    if constexpr (CollectStats) {
+      if (stats)
+        stats->probes++;
+    }
 
     for (int i = 0; i < EntriesPerBucket; i++) {
       if (entries[i].matches(key) || entries[i].isEmpty()) {
-        hit = ! entries[i].isEmpty();
-        entries[i].updateAge();
-        return & entries[i];
+        hit = consistent && ! entries[i].isEmpty();
+
+        if constexpr (CollectStats) {
+          if (hit && stats) {
+            stats->hits++;
+            const Key fullKey = fullKeyOf(& bucket->entries[i]);
+            // Entries loaded from a file without full keys are unknown (0)
+            stats->falseHits += fullKey && fullKey != key;
+          }
+        }
+
+        if (hit) {
+          data = entries[i];
+          if (data.getAge() != tableAge)
+            bucket->entries[i].updateAge();
+        }
+        return & bucket->entries[i];
       }
     }
 
-    Entry* worstEntry = & entries[0];
+    int worst = 0;
 
     for (int i = 1; i < EntriesPerBucket; i++) {
-      if (entries[i].getQuality() < worstEntry->getQuality())
-        worstEntry = & entries[i];
+      if (entries[i].getQuality() < entries[worst].getQuality())
+        worst = i;
     }
 
     hit = false;
-    return worstEntry;
+    return & bucket->entries[worst];
+  }
+
+  Entry* probe(Key key, bool& hit, Entry& data) {
+    return probe(getBucket(key), key, hit, data);
+  }
+
+  Entry* probeQsearch(Key key, bool& hit, Entry& data) {
+    Entry* entry = probe(key, hit, data);
+    if (hit || !qsBuckets)
+      return entry;
+
+    return probe(getBucket(qsBuckets, qsBucketCount, key), key, hit, data);
+  }
+
+  bool isShared() {
+    return shared != nullptr;
   }
 
   int hashfull() {
@@ -88,6 +578,22 @@ namespace TT {
 
   void Entry::store(Key _key, Flag _bound, int _depth, Move _move, Score _score, Score _eval, bool isPV, int ply) {
 
+    Bucket* bucket = bucketOf(this);
+    uint16_t sequence;
+    const bool locked = lockBucket(bucket, sequence);
+
+    Stats* stats = inQsearchTable(this) ? nullptr : threadStats;
+
+    if constexpr (CollectStats) {
+      if (stats) {
+        stats->stores++;
+        stats->dropped += !locked;
+      }
+    }
+
+    if (!locked)
+      return;
+
      if (!matches(_key) || _move)
         this->move = _move;
 
@@ -102,20 +608,215 @@ namespace TT {
       || !matches(_key)
       || _depth + 4 + 2*isPV > this->depth) {
 
+        if constexpr (CollectStats) {
+          if (stats && !matches(_key) && !isEmpty()) {
+            stats->replaced++;
+            stats->replacedDeeper += this->depth > _depth;
+          }
+          if (!inQsearchTable(this))
+            fullKeyOf(this) = _key;
+        }
+
         this->key16 = (uint16_t) _key;
         this->depth = _depth;
         this->score = _score;
         this->staticEval = _eval;
         this->agePvBound = _bound | (isPV << 2) | (tableAge << 3);
       }
+    else if constexpr (CollectStats) {
+      if (stats)
+        stats->kept++;
+    }
+
+    unlockBucket(bucket, sequence);
   }
 
   void Entry::updateAge() {
+    Bucket* bucket = bucketOf(this);
+    uint16_t sequence;
+    if (!lockBucket(bucket, sequence))
+      return;
+
     agePvBound = (agePvBound & (FLAG_EXACT | FLAG_PV)) | (tableAge << 3);
+
+    unlockBucket(bucket, sequence);
+  }
+
+  void Entry::makeReplaceable() {
+    depth = 0;
   }
 
   int Entry::getQuality() {
     int ageDistance = (MAX_AGE + tableAge - getAge()) % MAX_AGE;
     return depth - 8 * ageDistance;
   }
+
+  Stats& Stats::operator+=(const Stats& other) {
+    probes += other.probes;
+    hits += other.hits;
+    falseHits += other.falseHits;
+    stores += other.stores;
+    dropped += other.dropped;
+    kept += other.kept;
+    replaced += other.replaced;
+    replacedDeeper += other.replacedDeeper;
+    return *this;
+  }
+
+  void setThreadStats(Stats* stats) {
+    threadStats = stats;
+  }
+
+  void recordSearch(const Stats& stats) {
+    lastSearch = stats;
+    allSearches += stats;
+  }
+
+  void printStats() {
+    // Unlike hashfull, over all the buckets
+    uint64_t current = 0, used = 0;
+    for (uint64_t i = 0; i < bucketCount; i++) {
+      for (int j = 0; j < EntriesPerBucket; j++) {
+        const Entry& entry = buckets[i].entries[j];
+        if (!entry.isEmpty()) {
+          used++;
+          current += entry.getAge() == tableAge;
+        }
+      }
+    }
+
+    const double entries = double(bucketCount * EntriesPerBucket);
+
+    std::cout << std::fixed << std::setprecision(2)
+              << "Entries:          " << uint64_t(entries)
+              << "\nUsed:             " << used << " (" << 100.0 * used / entries << "%)"
+              << "\nFrom this search: " << current << " (" << 100.0 * current / entries << "%)";
+
+    if constexpr (!CollectStats) {
+      std::cout << "\nProbe and store counters are not compiled in, build with ttstats=yes"
+                << std::defaultfloat << std::endl;
+      return;
+    }
+
+    for (const Stats* stats : { &lastSearch, &allSearches }) {
+      auto percent = [](uint64_t n, uint64_t total) {
+        return total ? 100.0 * n / total : 0.0;
+      };
+
+      std::cout << (stats == &lastSearch ? "\n\nLast search" : "\n\nAll searches")
+                << "\nProbes:           " << stats->probes
+                << "\nHits:             " << stats->hits << " (" << percent(stats->hits, stats->probes) << "%)"
+                << "\nFalse hits:       " << stats->falseHits << " (" << percent(stats->falseHits, stats->hits) << "% of hits)"
+                << "\nStores:           " << stats->stores
+                << "\nDropped:          " << stats->dropped << " (" << percent(stats->dropped, stats->stores) << "%)"
+                << "\nKept old data:    " << stats->kept << " (" << percent(stats->kept, stats->stores) << "%)"
+                << "\nReplaced other:   " << stats->replaced << " (" << percent(stats->replaced, stats->stores) << "%)"
+                << "\n  deeper ones:    " << stats->replacedDeeper << " (" << percent(stats->replacedDeeper, stats->replaced) << "%)";
+    }
+
+    std::cout << std::defaultfloat << std::endl;
+  }
+
+  bool readHeader(std::ifstream& file, const std::string& path, SavedHeader& header) {
+    file.read((char*) &header, sizeof(header));
+
+    if ( !file
+      || memcmp(header.magic, SavedMagic, sizeof(SavedMagic)) != 0
+      || header.bucketSize != sizeof(Bucket)
+      || header.entriesPerBucket != EntriesPerBucket
+      || header.bucketCount != header.megaBytes * MEGA / sizeof(Bucket)
+      || header.tableAge >= MAX_AGE) {
+      std::cout << "info string " << path << " is not a saved hash table" << std::endl;
+      return false;
+    }
+    return true;
+  }
+
+  bool save(const std::string& path) {
+    int64_t begin = timeMillis();
+
+    SavedHeader header = {};
+    memcpy(header.magic, SavedMagic, sizeof(SavedMagic));
+    header.bucketSize = sizeof(Bucket);
+    header.entriesPerBucket = EntriesPerBucket;
+    header.megaBytes = tableMegaBytes;
+    header.bucketCount = bucketCount;
+    header.tableAge = tableAge;
+    header.hasFullKeys = CollectStats;
+
+    std::ofstream file(path, std::ios::binary);
+    file.write((const char*) &header, sizeof(header));
+    file.write((const char*) buckets, sizeof(Bucket) * bucketCount);
+    if constexpr (CollectStats)
+      file.write((const char*) fullKeys.data(), sizeof(Key) * fullKeys.size());
+
+    if (!file) {
+      std::cout << "info string Could not write " << path << std::endl;
+      return false;
+    }
+
+    std::cout << "info string Saved " << tableMegaBytes << " MB hash to " << path
+              << " in " << timeMillis() - begin << " ms" << std::endl;
+    return true;
+  }
+
+  bool savedSize(const std::string& path, size_t& megaBytes) {
+    std::ifstream file(path, std::ios::binary);
+    if (!file) {
+      std::cout << "info string Could not open " << path << std::endl;
+      return false;
+    }
+
+    SavedHeader header;
+    if (!readHeader(file, path, header))
+      return false;
+
+    megaBytes = header.megaBytes;
+    return true;
+  }
+
+  bool load(const std::string& path) {
+    int64_t begin = timeMillis();
+
+    std::ifstream file(path, std::ios::binary);
+    SavedHeader header;
+    if (!file || !readHeader(file, path, header))
+      return false;
+
+    if (header.bucketCount != bucketCount) {
+      std::cout << "info string " << path << " holds a " << header.megaBytes
+                << " MB hash, the current one is " << tableMegaBytes << " MB" << std::endl;
+      return false;
+    }
+
+    file.read((char*) buckets, sizeof(Bucket) * bucketCount);
+
+    if constexpr (CollectStats) {
+      if (header.hasFullKeys)
+        file.read((char*) fullKeys.data(), sizeof(Key) * fullKeys.size());
+      else
+        std::fill(fullKeys.begin(), fullKeys.end(), 0);
+    }
+
+    if (!file) {
+      std::cout << "info string " << path << " is truncated" << std::endl;
+      clear();
+      return false;
+    }
+
+    // A shared table may have been saved while another process held a bucket. Its odd
+    // sequence would keep the bucket locked for good
+    for (uint64_t i = 0; i < bucketCount; i++)
+      buckets[i].sequence.store(0, std::memory_order_relaxed);
+
+    // Entries keep their age relative to the saved table, so the previous session's
+    // last search is still the newest one
+    tableAge = header.tableAge;
+    if (shared)
+      shared->tableAge = tableAge;
+
+    std::cout << "info string Loaded " << tableMegaBytes << " MB hash from " << path
+              << " in " << timeMillis() - begin << " ms, hashfull " << hashfull() << std::endl;
+    return true;
+  }
 }
@@ -2,6 +2,9 @@
 
 #include "position.h"
 
+#include <atomic>
+#include <string>
+
 
 namespace TT {
 
@@ -14,14 +17,49 @@ namespace TT {
     FLAG_EXACT = FLAG_LOWER | FLAG_UPPER,
     FLAG_PV = 4;
 
+  // By default a bucket is half a cache line. With TT_BUCKET64 (make ttbucket=64) it
+  // takes a whole line, so that a probe looks at twice as many entries for the same miss
+#ifdef TT_BUCKET64
+  constexpr int EntriesPerBucket = 6;
+  constexpr int BucketSize = 64;
+#else
   constexpr int EntriesPerBucket = 3;
+  constexpr int BucketSize = 32;
+#endif
+
+  // Counting what the table does costs a little speed and, to tell false hits apart,
+  // 8 more bytes per entry. Enable with TT_STATS (make ttstats=yes)
+#ifdef TT_STATS
+  constexpr bool CollectStats = true;
+#else
+  constexpr bool CollectStats = false;
+#endif
+
+  struct Stats {
+    uint64_t probes = 0;
+    uint64_t hits = 0;
+    uint64_t falseHits = 0;      // Hits on the key16 of another position
+    uint64_t stores = 0;
+    uint64_t dropped = 0;        // Another thread was writing into the bucket
+    uint64_t kept = 0;           // Same position, the old data was deep enough to stay
+    uint64_t replaced = 0;       // Another position was evicted
+    uint64_t replacedDeeper = 0; // ... which had a greater depth than the new one
+
+    Stats& operator+=(const Stats& other);
+  };
 
   struct Entry {
 
+    // Safe to call while other threads probe or write into the same bucket. If another
+    // thread is in the middle of writing into it, the store is dropped
     void store(Key _key, Flag _bound, int _depth, Move _move, Score _score, Score _eval, bool isPV, int ply);
 
     void updateAge();
 
+    /// Gives the entry depth 0, so that any store replaces it. Doesn't lock the bucket
+    /// (for tables not in use yet)
+    void makeReplaceable();
+
     int getQuality();
 
     inline bool matches(Key key) const {
@@ -77,11 +115,16 @@ namespace TT {
     int16_t score;
   };
 
-  struct Bucket {
+  // Entries are read and written under a per bucket seqlock: writers make the sequence
+  // odd while they write, readers copy the bucket and only trust the copy if the
+  // sequence was even and didn't change meanwhile
+  struct alignas(BucketSize) Bucket {
     Entry entries[EntriesPerBucket];
-    int16_t padding;
+    std::atomic<uint16_t> sequence;
   };
 
+  static_assert(sizeof(Bucket) == BucketSize);
+
   // Initialize/clear the TT
   void clear();
 
@@ -89,9 +132,48 @@ namespace TT {
 
   void resize(size_t megaBytes);
 
+  // Frees the table, or detaches from it if it's shared
+  void release();
+
+  // Makes the next resize place the table in the named POSIX shared memory segment, so
+  // that all the engine processes using the same name probe and store into one table.
+  // An empty name goes back to a private table
+  void setSharedName(const std::string& name);
+
+  bool isShared();
+
   void prefetch(Key key);
 
-  Entry* probe(Key key, bool& hit);
+  // Returns the entry to store the position into. On a hit, data is a consistent copy of it
+  Entry* probe(Key key, bool& hit, Entry& data);
+
+  // The optional qsearch table holds the qsearch results of positions missing from the
+  // main table, so that they don't evict deeper entries there. 0 MB disables it
+  void resizeQsearch(size_t megaBytes);
+
+  // Same as probe, but falls back to the qsearch table on a miss
+  Entry* probeQsearch(Key key, bool& hit, Entry& data);
+
+  void prefetchQsearch(Key key);
 
   int hashfull();
+
+  // Statistics of probes and stores go to the given counters, for the calling thread
+  void setThreadStats(Stats* stats);
+
+  // Adds up the counters of a finished search
+  void recordSearch(const Stats& stats);
+
+  // Prints the counters of the last search and of all the searches, and the occupancy
+  // of the whole table
+  void printStats();
+
+  // Writes the table and its age to a file. Must not be called during a search
+  bool save(const std::string& path);
+
+  // Reads the size in MB of a table written by save, so that the table can be resized to it
+  bool savedSize(const std::string& path, size_t& megaBytes);
+
+  // Reads back a table written by save. The current table must already have its size
+  bool load(const std::string& path);
 }
@@ -9,11 +9,17 @@
 #include "tt.h"
 #include "tuning.h"
 
+#include <atomic>
 #include <cassert>
+#include <chrono>
 #include <cmath>
+#include <fstream>
+#include <iomanip>
 #include <iostream>
+#include <random>
 #include <sstream>
 #include <string>
+#include <thread>
 #include <vector>
 
 namespace {
@@ -63,10 +69,14 @@ namespace {
 
   void newGame() {
 
-    TT::clear();
+    // The other processes using a shared table are still searching
+    if (!TT::isShared())
+      TT::clear();
 
-    for (Search::Thread* st : Threads::searchThreads)
+    for (Search::Thread* st : Threads::searchThreads) {
       st->resetHistories();
+      st->invalidateFinny();
+    }
   }
 
   void qc(Position& pos) {
@@ -78,11 +88,12 @@ namespace {
     }
   }
 
-  void bench() {
+  // Searches the bench positions. The first 5 are left out of the nodes and time returned
+  void runBench(uint64_t& totalNodes, int64_t& elapsed) {
     constexpr int posCount = sizeof(BENCH_POSITIONS) / sizeof(char*);
 
-    uint64_t totalNodes = 0;
-    int64_t elapsed = 0;
+    totalNodes = 0;
+    elapsed = 0;
 
     std::string oldMinimal = Options["Minimal"];
     Options["Minimal"] = std::string("true");
@@ -113,9 +124,412 @@ namespace {
       }
     }
 
+    Options["Minimal"] = oldMinimal;
+  }
+
+  void bench() {
+    uint64_t totalNodes;
+    int64_t elapsed;
+    runBench(totalNodes, elapsed);
+
     std::cout << totalNodes << " nodes " << (totalNodes * 1000 / elapsed) << " nps" << std::endl;
+  }
 
-    Options["Minimal"] = oldMinimal;
+  // Runs many depth 1 searches back to back. Reports how long the threads take to join a
+  // search, and the whole round trip from starting a search to being done waiting for it
+  void startlatency(std::istringstream& is) {
+    int count = 1000;
+    is >> count;
+    count = std::max(count, 1);
+
+    Threads::waitForSearch();
+
+    int64_t meanSum = 0, maxSum = 0, worst = 0, roundTrip = 0;
+
+    for (int i = 0; i < count; i++) {
+      Search::Settings searchSettings;
+      searchSettings.depth = 1;
+      searchSettings.silent = true;
+      searchSettings.position.setToFen(StartFEN);
+      searchSettings.startTime = timeMillis();
+
+      const auto begin = std::chrono::steady_clock::now();
+      Threads::startSearch(searchSettings);
+      Threads::waitForSearch();
+      roundTrip += std::chrono::duration_cast<std::chrono::nanoseconds>(
+        std::chrono::steady_clock::now() - begin).count();
+
+      const Threads::StartLatency latency = Threads::lastStartLatency();
+      meanSum += latency.mean;
+      maxSum += latency.max;
+      worst = std::max(worst, latency.max);
+    }
+
+    std::cout << Threads::searchThreads.size() << " threads, " << count << " searches: start latency mean "
+              << meanSum / count / 1000 << " us, last thread " << maxSum / count / 1000 << " us (worst "
+              << worst / 1000 << " us), round trip " << roundTrip / count / 1000 << " us" << std::endl;
+  }
+
+  // Runs the bench with 1, 2, 4... threads up to the given count (all the cores by default)
+  void benchscale(std::istringstream& is) {
+    int maxThreads = std::max<int>(std::thread::hardware_concurrency(), 1);
+    is >> maxThreads;
+
+    const std::string oldThreads = Options["Threads"];
+    uint64_t baseNps = 0;
+
+    for (int threads = 1; ; threads = std::min(threads * 2, maxThreads)) {
+      Options["Threads"] = std::to_string(threads);
+
+      uint64_t totalNodes;
+      int64_t elapsed;
+      runBench(totalNodes, elapsed);
+
+      const uint64_t nps = totalNodes * 1000 / std::max<int64_t>(elapsed, 1);
+      if (threads == 1)
+        baseNps = nps;
+
+      std::cout << "threads " << threads << ": " << totalNodes << " nodes " << nps << " nps, speedup "
+                << std::fixed << std::setprecision(2) << double(nps) / std::max<uint64_t>(baseNps, 1)
+                << std::defaultfloat << std::endl;
+
+      if (threads >= maxThreads)
+        break;
+    }
+
+    Options["Threads"] = oldThreads;
+  }
+
+  // Print the hit rate of the eval caches of all threads since startup
+  void evalcachestats() {
+    uint64_t probes = 0, hits = 0;
+    size_t bytes = 0;
+    for (Search::Thread* st : Threads::searchThreads) {
+      probes += st->evalCache.probes;
+      hits += st->evalCache.hits;
+      bytes += st->evalCache.sizeBytes();
+    }
+
+    std::cout << std::fixed << std::setprecision(1)
+              << "Eval cache size: " << bytes / 1024 << " KB over " << Threads::searchThreads.size() << " threads"
+              << "\nProbes:          " << probes
+              << "\nHits:            " << hits << " (" << (probes ? 100.0 * hits / probes : 0.0) << "%)"
+              << std::defaultfloat << std::endl;
+  }
+
+  // Whether setToFen can read the FEN: 8 full ranks with one king per side and no pawns
+  // on the back ranks, then the side to move, castling, en passant and optional counters
+  bool isValidFen(const std::string& fen) {
+    // setToFen expects single spaces between the fields
+    if (fen[0] == ' ' || fen.find("  ") != std::string::npos || fen.find('\t') != std::string::npos)
+      return false;
+
+    std::istringstream ss(fen);
+    std::string board, side, castling, ep, counter;
+    if (!(ss >> board >> side >> castling >> ep))
+      return false;
+
+    int rank = 0, file = 0, kings[COLOR_NB] = {};
+    for (char c : board) {
+      if (c == '/') {
+        if (file != 8 || ++rank > 7)
+          return false;
+        file = 0;
+      }
+      else if (c >= '1' && c <= '8')
+        file += c - '0';
+      else if (std::string("pnbrqkPNBRQK").find(c) != std::string::npos) {
+        if ((c == 'p' || c == 'P') && (rank == 0 || rank == 7))
+          return false;
+        kings[WHITE] += c == 'K';
+        kings[BLACK] += c == 'k';
+        file++;
+      }
+      else
+        return false;
+
+      if (file > 8)
+        return false;
+    }
+
+    if (rank != 7 || file != 8 || kings[WHITE] != 1 || kings[BLACK] != 1)
+      return false;
+
+    if (side != "w" && side != "b")
+      return false;
+
+    if (castling != "-" && castling.find_first_not_of("KQkqABCDEFGHabcdefgh") != std::string::npos)
+      return false;
+
+    if (ep != "-" && (ep.size() != 2 || ep[0] < 'a' || ep[0] > 'h' || (ep[1] != '3' && ep[1] != '6')))
+      return false;
+
+    while (ss >> counter)
+      if (counter.find_first_not_of("0123456789") != std::string::npos)
+        return false;
+
+    return true;
+  }
+
+  // Evaluates every FEN of a file (one per line, anything after '|' or ';' is ignored)
+  // with all threads, and writes "<fen> | <white relative cp>" lines to the output file or stdout.
+  // Lines which are not a FEN are skipped and counted
+  void evalbatch(std::istringstream& is) {
+    constexpr int ChunkSize = 1 << 16;
+
+    std::string inPath, outPath;
+    is >> inPath >> outPath;
+
+    std::ifstream in(inPath);
+    if (!in) {
+      std::cout << "info string Could not open " << inPath << std::endl;
+      return;
+    }
+
+    std::ofstream outFile;
+    if (!outPath.empty())
+      outFile.open(outPath);
+    std::ostream& out = outPath.empty() ? std::cout : outFile;
+
+    const int threadCount = Threads::searchThreads.size();
+
+    std::vector<Position> positions;
+    std::vector<Score> scores;
+    std::vector<std::string> fens;
+    uint64_t total = 0, skipped = 0;
+    int64_t evalTime = 0;
+    int64_t begin = timeMillis();
+
+    std::string line;
+    while (in) {
+      positions.clear();
+      fens.clear();
+
+      while ((int) fens.size() < ChunkSize && std::getline(in, line)) {
+        line = line.substr(0, line.find_first_of("|;"));
+        line.erase(line.find_last_not_of(" \t\r") + 1);
+        if (line.empty())
+          continue;
+
+        if (!isValidFen(line)) {
+          skipped++;
+          continue;
+        }
+
+        fens.push_back(line);
+        positions.emplace_back();
+        positions.back().setToFen(line);
+      }
+
+      const int count = positions.size();
+      scores.resize(count);
+
+      int64_t evalBegin = timeMillis();
+
+      std::vector<std::thread> workers;
+      for (int t = 0; t < threadCount; t++) {
+        int from = int(int64_t(count) * t / threadCount);
+        int to = int(int64_t(count) * (t + 1) / threadCount);
+        workers.emplace_back(NNUE::evaluateBatch, positions.data() + from, scores.data() + from, to - from);
+      }
+      for (std::thread& worker : workers)
+        worker.join();
+
+      evalTime += timeMillis() - evalBegin;
+
+      for (int i = 0; i < count; i++) {
+        Score eval = positions[i].sideToMove == WHITE ? scores[i] : -scores[i];
+        out << fens[i] << " | " << UCI::normalizeToCp(eval) << "\n";
+      }
+      total += count;
+    }
+    out << std::flush;
+
+    int64_t elapsed = std::max<int64_t>(timeMillis() - begin, 1);
+
+    std::cout << "info string Evaluated " << total << " positions in " << elapsed << " ms"
+              << ", " << total * 1000 / elapsed << " pos/s"
+              << " (evaluation only " << total * 1000 / std::max<int64_t>(evalTime, 1) << " pos/s)"
+              << (skipped ? ", " + std::to_string(skipped) + " invalid lines skipped" : "")
+              << std::endl;
+  }
+
+  std::vector<Position> benchPositions() {
+    constexpr int posCount = sizeof(BENCH_POSITIONS) / sizeof(char*);
+
+    std::vector<Position> positions(posCount);
+    for (int i = 0; i < posCount; i++) {
+      std::istringstream posStr(BENCH_POSITIONS[i]);
+      position(positions[i], posStr);
+    }
+    return positions;
+  }
+
+  void evalbench() {
+    std::vector<Position> positions = benchPositions();
+    NNUE::benchOutput(positions.data(), positions.size());
+  }
+
+  // Writes an 8 bit version of the current network, to be loaded with EvalFile
+  void convertnet(std::istringstream& is) {
+    std::string path;
+    is >> path;
+    if (path.empty()) {
+      std::cout << "info string Usage: convertnet <output file>" << std::endl;
+      return;
+    }
+
+    std::vector<Position> positions = benchPositions();
+    NNUE::convertNetwork(path, positions.data(), positions.size());
+  }
+
+  // Print the accumulator work done by all threads since startup
+  void accstats() {
+    Search::AccumulatorStats total;
+    for (Search::Thread* st : Threads::searchThreads)
+      total += st->accStats;
+
+    auto percent = [&](uint64_t n) {
+      return total.pushed ? 100.0 * n / total.pushed : 0.0;
+    };
+
+    std::cout << std::fixed << std::setprecision(1)
+              << "Accumulators pushed: " << total.pushed << " (perspectives)"
+              << "\nIncremental:         " << total.incremental << " (" << percent(total.incremental) << "%)"
+              << "\nMulti-ply catch-up:  " << total.fused << " (" << percent(total.fused) << "%)"
+              << "\nRefreshed:           " << total.refreshed << " (" << percent(total.refreshed) << "%)"
+              << "\nSkipped:             " << total.skipped << " (" << percent(total.skipped) << "%)"
+              << std::defaultfloat << std::endl;
+  }
+
+  void savehash(std::istringstream& is) {
+    std::string path;
+    is >> path;
+    if (path.empty()) {
+      std::cout << "info string Usage: savehash <file>" << std::endl;
+      return;
+    }
+
+    Threads::waitForSearch();
+    TT::save(path);
+  }
+
+  // Loads a table written by savehash, changing the Hash option to its size if needed
+  void loadhash(std::istringstream& is) {
+    std::string path;
+    is >> path;
+    if (path.empty()) {
+      std::cout << "info string Usage: loadhash <file>" << std::endl;
+      return;
+    }
+
+    Threads::waitForSearch();
+
+    size_t megaBytes;
+    if (!TT::savedSize(path, megaBytes))
+      return;
+
+    if (megaBytes != size_t(int(Options["Hash"])))
+      Options["Hash"] = std::to_string(megaBytes);
+
+    TT::load(path);
+  }
+
+  // Hammers a few TT buckets from many threads, and counts the hits whose content doesn't
+  // belong to the key. Everything stored is derived from the 16 bit key, so hits on
+  // key16 collisions are still consistent: only torn entries get counted.
+  // It runs on the real table, which gets cleared before and after the test
+  void ttstress(std::istringstream& is) {
+    constexpr int BucketsUsed = 1024;
+
+    int threadCount = 64, seconds = 5;
+    is >> threadCount >> seconds;
+
+    Threads::waitForSearch();
+
+    // Clearing it would wipe the table of the other processes too
+    if (TT::isShared()) {
+      std::cout << "info string ttstress needs a private hash table (SharedHash is set)" << std::endl;
+      return;
+    }
+
+    std::cout << "info string ttstress clears the hash table" << std::endl;
+
+    struct Expected {
+      Move move;
+      Score score, eval;
+      int depth;
+
+      Expected(uint16_t key16) :
+        move(uint16_t(key16 * 40503) | 1),
+        score(int(key16 % 20001) - 10000),
+        eval(int(key16 * 7919 % 20001) - 10000),
+        depth(1 + key16 % 60) {}
+    };
+
+    // Keys that differ only in the low bits land in the same bucket. With 64 keys per
+    // bucket, a fair share of the probes hit
+    Key bases[BucketsUsed];
+    std::mt19937_64 gen(1234);
+    for (int i = 0; i < BucketsUsed; i++)
+      bases[i] = gen() & ~0xFFFFULL;
+
+    TT::clear();
+
+    std::atomic<bool> stop = false;
+    std::atomic<uint64_t> probes = 0, hits = 0, corrupted = 0;
+
+    auto worker = [&](int index) {
+      std::mt19937_64 rng(index);
+      uint64_t localProbes = 0, localHits = 0, localCorrupted = 0;
+
+      while (!stop.load(std::memory_order_relaxed)) {
+        for (int i = 0; i < 1024; i++) {
+          uint64_t r = rng();
+          Key key = bases[r % BucketsUsed] | (r >> 58);
+          Expected expected{ uint16_t(key) };
+
+          bool hit;
+          TT::Entry data;
+          TT::Entry* entry = TT::probe(key, hit, data);
+
+          localProbes++;
+          if (hit) {
+            localHits++;
+            if ( data.getMove() != expected.move
+              || data.getScore(0) != expected.score
+              || data.getStaticEval() != expected.eval
+              || data.getDepth() != expected.depth)
+              localCorrupted++;
+          }
+
+          entry->store(key, TT::FLAG_EXACT, expected.depth, expected.move, expected.score, expected.eval, false, 0);
+        }
+      }
+
+      probes += localProbes;
+      hits += localHits;
+      corrupted += localCorrupted;
+    };
+
+    std::vector<std::thread> workers;
+    for (int t = 0; t < threadCount; t++)
+      workers.emplace_back(worker, t);
+
+    std::this_thread::sleep_for(std::chrono::seconds(seconds));
+    stop = true;
+
+    for (std::thread& w : workers)
+      w.join();
+
+    TT::clear();
+
+    std::cout << std::setprecision(3)
+              << "Threads:   " << threadCount << " on " << BucketsUsed << " buckets"
+              << "\nProbes:    " << probes
+              << "\nHits:      " << hits
+              << "\nCorrupted: " << corrupted << " (" << (hits ? 1e6 * corrupted / hits : 0.0) << " per million hits)"
+              << std::defaultfloat << std::endl;
   }
 
   void setoption(std::istringstream& is) {
@@ -221,6 +635,18 @@ void UCI::loop(int argc, char* argv[]) {
     }
     else if (token == "qc")         qc(pos);
     else if (token == "bench")      bench();
+    else if (token == "benchscale") benchscale(is);
+    else if (token == "startlatency") startlatency(is);
+    else if (token == "evalbench")  evalbench();
+    else if (token == "evalbatch")  evalbatch(is);
+    else if (token == "convertnet") convertnet(is);
+    else if (token == "accstats")   accstats();
+    else if (token == "evalcachestats") evalcachestats();
+    else if (token == "ttstress")   ttstress(is);
+    else if (token == "ttstats")    TT::printStats();
+    else if (token == "limitstats") Search::printLimitStats();
+    else if (token == "savehash")   savehash(is);
+    else if (token == "loadhash")   loadhash(is);
     else if (token == "setoption")  setoption(is);
     else if (token == "go")         go(pos, is);
     else if (token == "position")   position(pos, is);
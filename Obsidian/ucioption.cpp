@@ -1,5 +1,6 @@
 #include "uci.h"
 #include "fathom/src/tbprobe.h"
+#include "numa.h"
 #include "threads.h"
 #include "tt.h"
 
@@ -13,6 +14,11 @@ UCI::OptionsMap Options;
 
 namespace UCI {
 
+void qsHashChanged(const Option& o) {
+   Threads::waitForSearch();
+   TT::resizeQsearch(size_t(o));
+}
+
 void clearHashClicked(const Option&)   {
    TT::clear();
 }
@@ -21,10 +27,53 @@ void hashChanged(const Option& o) {
    TT::resize(size_t(o));
 }
 
+void sharedHashChanged(const Option& o) {
+  Threads::waitForSearch();
+  TT::setSharedName(o);
+  TT::resize(Options["Hash"]);
+}
+
 void threadsChanged(const Option& o) {
   Threads::setThreadCount(int(o));
 }
 
+void bindThreadsChanged(const Option& o) {
+  // Recreate all the threads, so that they get pinned and allocated again
+  Numa::setBinding(o);
+  Threads::setThreadCount(0);
+  Threads::setThreadCount(Options["Threads"]);
+  NNUE::setReplication(Options["ReplicateNet"]);
+
+  if (o)
+    std::cout << "info string Threads bound over " << Numa::describe() << std::endl;
+}
+
+void replicateNetChanged(const Option& o) {
+  Threads::waitForSearch();
+  NNUE::setReplication(o);
+}
+
+void evalFileChanged(const Option& o) {
+  Threads::waitForSearch();
+  NNUE::loadEvalFile(o);
+
+  for (Search::Thread* st : Threads::searchThreads) {
+    st->invalidateFinny();
+    st->evalCache.clear();
+  }
+}
+
+void netLargePagesChanged(const Option& o) {
+  Threads::waitForSearch();
+  NNUE::setLargePages(o);
+}
+
+void evalCacheChanged(const Option& o) {
+  Threads::waitForSearch();
+  for (Search::Thread* st : Threads::searchThreads)
+    st->evalCache.resize(size_t(o));
+}
+
 void syzygyPathChanged(const Option& o) {
   std::string str = o;
   tb_init(str.c_str());
@@ -48,9 +97,18 @@ void init(OptionsMap& o) {
 
   o["Hash"]              << Option(64, 1, MaxHashMB, hashChanged);
   o["Clear Hash"]        << Option(clearHashClicked);
+  o["QSearchHash"]       << Option(0, 0, MaxHashMB, qsHashChanged);
+  o["SharedHash"]        << Option("", sharedHashChanged);
   o["Threads"]           << Option(1, 1, 1024, threadsChanged);
+  o["BindThreads"]       << Option(false, bindThreadsChanged);
+  o["EvalCache"]         << Option(0, 0, 1024, evalCacheChanged);
   o["Move Overhead"]     << Option(10, 0, 1000);
+  o["CheckInterval"]     << Option(1024, 1, 65536);
   o["SyzygyPath"]        << Option("", syzygyPathChanged);
+  o["EvalFile"]          << Option("", evalFileChanged);
+  o["NetLargePages"]     << Option(false, netLargePagesChanged);
+  o["ReplicateNet"]      << Option(false, replicateNetChanged);
+  o["WarmFinnyTable"]    << Option(false);
   o["Minimal"]           << Option("false");
   o["MultiPV"]           << Option(1, 1, MAX_MOVES);
 }